@@ -0,0 +1,332 @@
+/*
+ * Author: Suki Sahota
+ *
+ * Offline analyzer for the binary event log written by "qdisc -trace".
+ * Recomputes the emulation statistics, latency percentiles and per-packet
+ * timelines in a single streaming pass over the log.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "my_math.h"
+
+#include "event_log.h"
+
+#define MIC_TO_MIL  1000.0
+#define MIC_TO_SEC  1000000.0
+#define MIL_TO_SEC  1000.0
+
+/* Per-packet timeline, indexed by packet number */
+typedef struct tagTimeline {
+    uint64_t arrival;
+    uint64_t q1_enter, q1_leave;
+    uint64_t q2_enter, q2_leave;
+    uint64_t service_begin, service_end;
+    int server;
+} Timeline;
+
+/* Growable array of durations (microseconds) for percentiles */
+typedef struct tagSamples {
+    uint64_t *values;
+    long count;
+    long capacity;
+} Samples;
+
+Timeline *timelines;
+long num_timelines;
+
+Samples *stage_samples; /* indexed by stage number, 2 and up */
+int num_stage_samples;
+
+/* ----------------------- Utility Functions ----------------------- */
+
+void Usage() {
+    fprintf(stderr, "usage: qdisc-analyze [-timeline csvfile] tracefile\n");
+    exit(1);
+}
+
+void SamplesAdd(Samples *s, uint64_t value) {
+    if (s->count == s->capacity) {
+        s->capacity = (s->capacity == 0) ? 1024 : s->capacity * 2;
+        s->values = (uint64_t *) realloc(s->values,
+                                         s->capacity * sizeof(uint64_t));
+    }
+    s->values[s->count++] = value;
+}
+
+int CompareSamples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void PrintPercentiles(char *name, Samples *s) {
+    if (s->count == 0) {
+        fprintf(stdout, "\t%s = \"N/A\" no samples\n", name);
+        return;
+    }
+    qsort(s->values, s->count, sizeof(uint64_t), CompareSamples);
+    double pct[] = { 0.50, 0.90, 0.99, 0.999 };
+    char *label[] = { "p50", "p90", "p99", "p99.9" };
+    fprintf(stdout, "\t%s:", name);
+    for (int i = 0; i < 4; ++i) {
+        long idx = (long) (pct[i] * (s->count - 1));
+        fprintf(stdout, " %s = %.6g", label[i], s->values[idx] / MIC_TO_SEC);
+    }
+    fprintf(stdout, " max = %.6g\n", s->values[s->count - 1] / MIC_TO_SEC);
+}
+
+Timeline *GetTimeline(int num) {
+    if (num < 0) { return NULL; }
+    if (num >= num_timelines) {
+        long grown = max(num_timelines * 2, (long) num + 1024);
+        timelines = (Timeline *) realloc(timelines, grown * sizeof(Timeline));
+        memset(timelines + num_timelines, 0,
+               (grown - num_timelines) * sizeof(Timeline));
+        num_timelines = grown;
+    }
+    return &timelines[num];
+}
+
+Samples *GetStageSamples(int stage) {
+    if (stage >= num_stage_samples) {
+        int grown = stage + 1;
+        stage_samples = (Samples *) realloc(stage_samples,
+                                            grown * sizeof(Samples));
+        memset(stage_samples + num_stage_samples, 0,
+               (grown - num_stage_samples) * sizeof(Samples));
+        num_stage_samples = grown;
+    }
+    return &stage_samples[stage];
+}
+
+/* ----------------------- main() ----------------------- */
+
+int main(int argc, char *argv[]) {
+    char *trace_path = NULL;
+    char *timeline_path = NULL;
+    for (--argc, ++argv; argc > 0; --argc, ++argv) {
+        if (strcmp(*argv, "-timeline") == 0) {
+            if (argc == 1) { Usage(); }
+            timeline_path = *(++argv);
+            --argc;
+        } else if (*argv[0] == '-' || trace_path != NULL) {
+            Usage();
+        } else {
+            trace_path = *argv;
+        }
+    }
+    if (trace_path == NULL) { Usage(); }
+
+    FILE *fp = fopen(trace_path, "rb");
+    if (fp == NULL) {
+        perror(trace_path);
+        exit(1);
+    }
+    EventLogHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(EventRecord))
+    {
+        fprintf(stderr, "error in the input - %s is not a qdisc trace\n",
+                trace_path);
+        exit(1);
+    }
+    FILE *timeline_fp = NULL;
+    if (timeline_path != NULL) {
+        timeline_fp = fopen(timeline_path, "w");
+        if (timeline_fp == NULL) {
+            perror(timeline_path);
+            exit(1);
+        }
+        fprintf(timeline_fp, "packet,server,arrival,q1_enter,q1_leave,"
+                "q2_enter,q2_leave,service_begin,service_end\n");
+    }
+
+    int num_servers = (int) header.num_servers;
+    double *server_time = (double *) calloc(num_servers + 1, sizeof(double));
+    long arrived = 0, completed = 0, dropped = 0, removed = 0;
+    long accepted_tokens = 0, dropped_tokens = 0;
+    double total_inter_arrival = 0.0, total_service = 0.0;
+    double total_q1 = 0.0, total_q2 = 0.0;
+    double sum_x = 0.0, sum_x_sqr = 0.0; /* time in system, milliseconds */
+    uint64_t emulation_end = 0;
+    Samples q1_samples = { 0 }, q2_samples = { 0 };
+    Samples service_samples = { 0 }, system_samples = { 0 };
+
+    static EventRecord records[EVENT_LOG_BUFFERED];
+    size_t count;
+    while ((count = fread(records, sizeof(EventRecord),
+                          EVENT_LOG_BUFFERED, fp)) > 0)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            EventRecord *rec = &records[i];
+            Timeline *t = NULL;
+            switch (rec->type) {
+                case EV_PACKET_ARRIVES:
+                    ++arrived;
+                    total_inter_arrival += rec->value;
+                    t = GetTimeline(rec->num);
+                    t->arrival = rec->time;
+                    break;
+                case EV_PACKET_DROPPED:
+                    ++dropped;
+                    break;
+                case EV_Q1_ENTER:
+                    GetTimeline(rec->num)->q1_enter = rec->time;
+                    break;
+                case EV_Q1_LEAVE:
+                    total_q1 += rec->value;
+                    SamplesAdd(&q1_samples, rec->value);
+                    GetTimeline(rec->num)->q1_leave = rec->time;
+                    break;
+                case EV_Q2_ENTER:
+                    GetTimeline(rec->num)->q2_enter = rec->time;
+                    break;
+                case EV_Q2_LEAVE:
+                    total_q2 += rec->value;
+                    SamplesAdd(&q2_samples, rec->value);
+                    GetTimeline(rec->num)->q2_leave = rec->time;
+                    break;
+                case EV_SERVICE_BEGIN:
+                    t = GetTimeline(rec->num);
+                    t->service_begin = rec->time;
+                    t->server = rec->server;
+                    break;
+                case EV_SERVICE_END:
+                    ++completed;
+                    total_service += rec->value;
+                    SamplesAdd(&service_samples, rec->value);
+                    if (rec->server >= 1 && rec->server <= num_servers) {
+                        server_time[rec->server] += rec->value;
+                    }
+                    t = GetTimeline(rec->num);
+                    t->service_end = rec->time;
+                    uint64_t in_system = rec->time - t->arrival;
+                    SamplesAdd(&system_samples, in_system);
+                    sum_x += in_system / MIC_TO_MIL;
+                    sum_x_sqr += pow(in_system / MIC_TO_MIL, 2);
+                    if (timeline_fp != NULL) {
+                        fprintf(timeline_fp,
+                                "%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                                rec->num, t->server,
+                                t->arrival / MIC_TO_MIL,
+                                t->q1_enter / MIC_TO_MIL,
+                                t->q1_leave / MIC_TO_MIL,
+                                t->q2_enter / MIC_TO_MIL,
+                                t->q2_leave / MIC_TO_MIL,
+                                t->service_begin / MIC_TO_MIL,
+                                t->service_end / MIC_TO_MIL);
+                    }
+                    break;
+                case EV_STAGE_LEAVE:
+                    SamplesAdd(GetStageSamples(rec->stage), rec->value);
+                    break;
+                case EV_TOKEN_ARRIVES: /* the first bucket's tokens only */
+                    if (rec->stage == 0) { ++accepted_tokens; }
+                    break;
+                case EV_TOKEN_DROPPED:
+                    if (rec->stage == 0) { ++dropped_tokens; }
+                    break;
+                case EV_PACKET_REMOVED:
+                    ++removed;
+                    break;
+                case EV_EMULATION_ENDS:
+                    emulation_end = rec->time;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    fclose(fp);
+    if (timeline_fp != NULL) { fclose(timeline_fp); }
+
+    fprintf(stdout, "Statistics:\n");
+    fprintf(stdout, "\n");
+
+    if (arrived == 0) {
+        fprintf(stdout,
+                "\taverage packet inter-arrival time = \"N/A\" no packet arrived\n");
+    } else {
+        fprintf(stdout, "\taverage packet inter-arrival time = %.6g\n",
+                total_inter_arrival / arrived / MIC_TO_SEC);
+    }
+    if (completed == 0) {
+        fprintf(stdout,
+                "\taverage packet service time = \"N/A\" no packet served\n");
+    } else {
+        fprintf(stdout, "\taverage packet service time = %.6g\n",
+                total_service / completed / MIC_TO_SEC);
+    }
+    fprintf(stdout, "\n");
+
+    if (emulation_end == 0) {
+        fprintf(stdout, "\ttrace ends before the emulation ends\n");
+        emulation_end = 1;
+    }
+    fprintf(stdout, "\taverage number of packets in Q1 = %.6g\n",
+            total_q1 / emulation_end);
+    fprintf(stdout, "\taverage number of packets in Q2 = %.6g\n",
+            total_q2 / emulation_end);
+    for (int i = 1; i <= num_servers; ++i) {
+        fprintf(stdout, "\taverage number of packets in S%i = %.6g\n",
+                i, server_time[i] / emulation_end);
+    }
+    fprintf(stdout, "\n");
+
+    if (completed == 0) {
+        fprintf(stdout,
+                "\taverage time a packet spent in system = \"N/A\" no packet served\n");
+        fprintf(stdout,
+                "\tstandard deviation for time spent in system = \"N/A\" no packet served\n");
+    } else {
+        double avg_x = sum_x / completed;
+        double avg_x_sqr = sum_x_sqr / completed;
+        fprintf(stdout, "\taverage time a packet spent in system = %.6g\n",
+                avg_x / MIL_TO_SEC);
+        fprintf(stdout, "\tstandard deviation for time spent in system = %.6g\n",
+                sqrt(max(avg_x_sqr - pow(avg_x, 2), 0.0)) / MIL_TO_SEC);
+    }
+    fprintf(stdout, "\n");
+
+    if (dropped_tokens + accepted_tokens == 0) {
+        fprintf(stdout, "\ttoken drop probability = \"N/A\" no token arrived\n");
+    } else {
+        fprintf(stdout, "\ttoken drop probability = %.6g\n",
+                (double) dropped_tokens / (dropped_tokens + accepted_tokens));
+    }
+    if (dropped + completed + removed == 0) {
+        fprintf(stdout, "\tpacket drop probability = \"N/A\" no packet arrived\n");
+    } else {
+        fprintf(stdout, "\tpacket drop probability = %.6g\n",
+                (double) dropped / (dropped + completed + removed));
+    }
+    fprintf(stdout, "\n");
+
+    fprintf(stdout, "Percentiles (seconds):\n");
+    fprintf(stdout, "\n");
+    PrintPercentiles("time in Q1", &q1_samples);
+    for (int i = 2; i < num_stage_samples; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "time in stage %i", i);
+        PrintPercentiles(name, &stage_samples[i]);
+    }
+    PrintPercentiles("time in Q2", &q2_samples);
+    PrintPercentiles("service time", &service_samples);
+    PrintPercentiles("time in system", &system_samples);
+
+    free(q1_samples.values);
+    free(q2_samples.values);
+    free(service_samples.values);
+    free(system_samples.values);
+    for (int i = 0; i < num_stage_samples; ++i) {
+        free(stage_samples[i].values);
+    }
+    free(stage_samples);
+    free(server_time);
+    free(timelines);
+    return(0);
+}
@@ -0,0 +1,340 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "my_math.h"
+
+#include "my_list.h"
+#include "event_log.h"
+#include "packet_store.h"
+#include "prio_queue.h"
+
+/*
+ * Microbenchmarks and an end-to-end harness for qdisc, linked against
+ * qdisc.c built with -DQDISC_BENCH (no main()).  The emulator's own
+ * output goes to /dev/null; results go to the original stdout as CSV
+ * rows of benchmark,metric,value,unit so runs from two commits can be
+ * diffed or joined.  Microbenchmarks report the best of BENCH_REPEATS.
+ */
+
+#define BENCH_OPS  1000000 /* operations per microbenchmark repeat */
+#define BENCH_PACKETS  100000 /* packets per bucket and parsing repeat */
+#define BENCH_REPEATS  5
+#define BENCH_E2E_PACKETS  "20000"
+
+/* BenchList() stores packet numbers in MyList as the object pointer */
+#define PACKET_OBJ(num)  ((void *) (long) (num))
+
+/* Defined in qdisc.c */
+extern PacketStore pkts;
+extern PrioQueue Q1, Q2;
+extern pthread_mutex_t mut;
+extern char buf[1026];
+extern double speed;
+extern unsigned long emulation_begin;
+extern int completed_packets, accepted_tokens, dropped_tokens;
+
+extern void Init();
+extern void InitServers();
+extern void ProcessOptions(int argc, char *argv[]);
+extern void Process();
+extern void Cleanup();
+extern void NextPacket(FILE *fp, int p);
+extern void TokenArrives(int t_num, unsigned long *last_tok_time);
+extern void CheckQ1();
+extern unsigned long GetTime(struct timeval *tv);
+extern unsigned long ScaleTime(unsigned long milliseconds);
+
+FILE *out; /* results; stdout itself is /dev/null */
+unsigned long allocations; /* counted by the --wrap'ed allocators below */
+
+/* ----------------------- Allocation Counting ----------------------- */
+
+/* Linked with -Wl,--wrap=malloc etc.; allocations made inside libc are not seen */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+/* ----------------------- Utility Functions ----------------------- */
+
+double Now() {
+    /* Monotonic nanoseconds */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void Report(char *bench, char *metric, double value, char *unit) {
+    fprintf(out, "%s,%s,%.6g,%s\n", bench, metric, value, unit);
+    fflush(out);
+}
+
+void ReportBest(char *bench, double *ns, int ops) {
+    double best = ns[0];
+    for (int i = 1; i < BENCH_REPEATS; ++i) {
+        best = min(best, ns[i]);
+    }
+    Report(bench, "ns_per_op", best / ops, "ns");
+}
+
+int CompareTimes(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+void ReportPercentiles(char *bench, char *event, double *samples, long count) {
+    /* samples in microseconds; sorted in place */
+    char metric[64];
+    static double points[] = { 50.0, 90.0, 99.0, 99.9 };
+    if (count == 0) { return; }
+    qsort(samples, count, sizeof(double), CompareTimes);
+    for (int i = 0; i < 4; ++i) {
+        long rank = (long) (points[i] / 100.0 * (count - 1) + 0.5);
+        snprintf(metric, sizeof(metric), "%s_p%g", event, points[i]);
+        Report(bench, metric, samples[rank], "us");
+    }
+    snprintf(metric, sizeof(metric), "%s_max", event);
+    Report(bench, metric, samples[count - 1], "us");
+}
+
+/* ----------------------- Microbenchmarks ----------------------- */
+
+void BenchList() {
+    /* FIFO churn on the allocating list library: append, then unlink the head */
+    double ns[BENCH_REPEATS];
+    MyList list;
+    MyListInit(&list);
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        double begin = Now();
+        for (int i = 1; i <= BENCH_OPS; ++i) {
+            MyListAppend(&list, PACKET_OBJ(i));
+            if (MyListLength(&list) > 16) {
+                MyListUnlink(&list, MyListFirst(&list));
+            }
+        }
+        ns[r] = Now() - begin;
+        MyListUnlinkAll(&list);
+    }
+    ReportBest("list_append_unlink", ns, BENCH_OPS);
+}
+
+void BenchPacketFifo() {
+    /* The same churn on the intrusive FIFO behind Q1, Q2 and -steal queues */
+    double ns[BENCH_REPEATS];
+    int *links = (int *) calloc(BENCH_OPS + 1, sizeof(int));
+    PacketFifo fifo;
+    PacketFifoInit(&fifo);
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        double begin = Now();
+        for (int i = 1; i <= BENCH_OPS; ++i) {
+            PacketFifoAppend(&fifo, links, i);
+            if (fifo.length > 16) { PacketFifoPop(&fifo, links); }
+        }
+        ns[r] = Now() - begin;
+        while (fifo.length > 0) { PacketFifoPop(&fifo, links); }
+    }
+    free(links);
+    ReportBest("packet_fifo_append_pop", ns, BENCH_OPS);
+}
+
+void BenchPrioQueue() {
+    /* Append across 8 bands, pop the highest-priority head */
+    double ns[BENCH_REPEATS];
+    int *links = (int *) calloc(BENCH_OPS + 1, sizeof(int));
+    PrioQueue queue;
+    PrioQueueInit(&queue, links);
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        double begin = Now();
+        for (int i = 1; i <= BENCH_OPS; ++i) {
+            PrioQueueAppend(&queue, i, i & 7);
+            if (PrioQueueLength(&queue) > 16) { PrioQueuePop(&queue); }
+        }
+        ns[r] = Now() - begin;
+        while (!PrioQueueEmpty(&queue)) { PrioQueuePop(&queue); }
+    }
+    free(links);
+    ReportBest("prio_queue_append_pop", ns, BENCH_OPS);
+}
+
+void BenchBucket(char *bench, char *trace) {
+    /*
+     * One refill and one consume per packet: it waits in Q1, a token
+     * arrives, CheckQ1() pays for it and moves it to Q2.  Logging to
+     * /dev/null is included, as in a real run.
+     */
+    double ns[BENCH_REPEATS];
+    Init();
+    InitServers(); /* none idle, so nothing is woken */
+    if (trace != NULL && !EventLogOpen(trace, 2)) {
+        perror(trace);
+        exit(1);
+    }
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        if (!PacketStoreInit(&pkts, BENCH_PACKETS)) {
+            fprintf(stderr, "error - cannot allocate records\n");
+            exit(1);
+        }
+        PrioQueueInit(&Q1, pkts.next);
+        PrioQueueInit(&Q2, pkts.next);
+        unsigned long last_token_time;
+        struct timeval tv;
+        emulation_begin = GetTime(&tv);
+
+        double begin = Now();
+        for (int p = 1; p <= BENCH_PACKETS; ++p) {
+            pthread_mutex_lock(&mut);
+            pkts.tokens_required[p] = 1;
+            PrioQueueAppend(&Q1, p, 0);
+            TokenArrives(p, &last_token_time);
+            CheckQ1();
+            PrioQueuePop(&Q2);
+            pthread_mutex_unlock(&mut);
+        }
+        ns[r] = Now() - begin;
+        PacketStoreFree(&pkts);
+    }
+    EventLogClose();
+    Cleanup();
+    ReportBest(bench, ns, BENCH_PACKETS);
+}
+
+void BenchTraceParsing() {
+    /* NextPacket() over a generated tsfile with a band column */
+    char path[] = "/tmp/qdisc-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *fp = (fd < 0) ? NULL : fdopen(fd, "w");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(fp, "%d\n", BENCH_PACKETS);
+    for (int p = 1; p <= BENCH_PACKETS; ++p) {
+        fprintf(fp, "%d %d %d %d\n", p % 997, 1 + p % 5, p % 313, p % 8);
+    }
+    fclose(fp);
+
+    double ns[BENCH_REPEATS];
+    Init();
+    for (int r = 0; r < BENCH_REPEATS; ++r) {
+        if (!PacketStoreInit(&pkts, BENCH_PACKETS)) {
+            fprintf(stderr, "error - cannot allocate records\n");
+            exit(1);
+        }
+        strcpy(buf, path); /* as after -t; NextPacket() reuses buf for lines */
+        fp = fopen(path, "r");
+        if (fp == NULL || fgets(buf, sizeof(buf), fp) == NULL) {
+            perror(path);
+            exit(1);
+        }
+        double begin = Now();
+        for (int p = 1; p <= BENCH_PACKETS; ++p) {
+            NextPacket(fp, p);
+        }
+        ns[r] = Now() - begin;
+        fclose(fp);
+        PacketStoreFree(&pkts);
+    }
+    *buf = '\0';
+    unlink(path);
+    ReportBest("trace_parse_line", ns, BENCH_PACKETS);
+}
+
+/* ----------------------- End-to-end Harness ----------------------- */
+
+void BenchEndToEnd(char *bench, char *runtime, char *runtime_arg) {
+    /*
+     * Every requested delay is 1ms, compressed by -speed to about 1us, so
+     * the emulator runs as fast as it can.  Lateness is how much longer
+     * than requested an arrival gap or a service took.
+     */
+    char *argv[] = {
+        "qdisc", "-n", BENCH_E2E_PACKETS, "-lambda", "1000", "-mu", "1000",
+        "-r", "1000", "-B", "10", "-P", "1", "-speed", "1000",
+        runtime, runtime_arg, NULL
+    };
+    int argc = 15 + (runtime != NULL) + (runtime_arg != NULL);
+
+    Init();
+    ProcessOptions(argc, argv);
+    allocations = 0UL;
+    double begin = Now();
+    Process();
+    double elapsed = Now() - begin;
+    unsigned long allocated = allocations;
+
+    long packets = 0L;
+    long served = 0L;
+    double *arrival_late = (double *) malloc(pkts.capacity * sizeof(double));
+    double *service_late = (double *) malloc(pkts.capacity * sizeof(double));
+    for (int p = 1; p <= pkts.capacity; ++p) {
+        if (pkts.arrival[p] == 0) { continue; }
+        arrival_late[packets++] = (double) pkts.inter_arrival_time[p] -
+            (double) ScaleTime(pkts.inter_arrival_requested[p]);
+        if (pkts.fate[p] == FATE_SERVED) {
+            service_late[served++] =
+                (double) (pkts.service_end[p] - pkts.service_begin[p]) -
+                (double) ScaleTime(pkts.service_time_requested[p]);
+        }
+    }
+    long events = packets + accepted_tokens + dropped_tokens + completed_packets;
+
+    Report(bench, "packets", packets, "count");
+    Report(bench, "events", events, "count");
+    Report(bench, "events_per_sec", events / (elapsed / 1e9), "1/s");
+    Report(bench, "allocs_per_packet",
+           (packets > 0) ? (double) allocated / packets : 0.0, "count");
+    ReportPercentiles(bench, "arrival_late", arrival_late, packets);
+    ReportPercentiles(bench, "service_late", service_late, served);
+
+    free(arrival_late);
+    free(service_late);
+    Cleanup();
+}
+
+/* ----------------------- main() ----------------------- */
+
+int main(int argc, char *argv[]) {
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("bench");
+        return(1);
+    }
+    fprintf(out, "benchmark,metric,value,unit\n");
+
+    BenchList();
+    BenchPacketFifo();
+    BenchPrioQueue();
+    BenchBucket("bucket_refill_consume", NULL);
+    BenchBucket("bucket_refill_consume_traced", "/dev/null");
+    BenchTraceParsing();
+
+    BenchEndToEnd("e2e_threads", NULL, NULL);
+    BenchEndToEnd("e2e_coro", "-coro", "1");
+    BenchEndToEnd("e2e_epoll", "-epoll", NULL);
+
+    fclose(out);
+    return(0);
+}
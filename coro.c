@@ -0,0 +1,304 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include "my_math.h"
+
+#include "coro.h"
+
+#define CORO_READY  0
+#define CORO_RUNNING  1
+#define CORO_PARKED  2
+#define CORO_SLEEPING  3
+#define CORO_DONE  4
+
+typedef struct tagCoroSched CoroSched;
+
+struct tagCoro {
+    ucontext_t ctx;
+    void *stack;
+    void (*func)(void *);
+    void *arg;
+    int state;
+    int wake_pending; /* woken while still running, before it parked */
+    unsigned long deadline; /* CORO_SLEEPING only */
+    CoroSched *sched;
+    Coro *next; /* run queue link */
+};
+
+struct tagCoroSched {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    ucontext_t ctx; /* scheduler loop, resumed whenever a coroutine yields */
+    Coro *run_head, *run_tail;
+    Coro **timers; /* min-heap on deadline */
+    int num_timers;
+    int max_coros;
+    int live; /* coroutines not yet finished */
+    unsigned long switches;
+};
+
+static CoroSched *scheds;
+static int num_scheds;
+static int next_sched; /* round-robin assignment */
+static Coro **coros;
+static int num_coros, max_coros_total;
+
+static __thread Coro *current;
+
+/* ----------------------- Utility Functions ----------------------- */
+
+static
+unsigned long NowMicros() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+static
+void RunQueuePush(CoroSched *sched, Coro *coro) {
+    coro->state = CORO_READY;
+    coro->next = NULL;
+    if (sched->run_tail == NULL) {
+        sched->run_head = coro;
+    } else {
+        sched->run_tail->next = coro;
+    }
+    sched->run_tail = coro;
+}
+
+static
+Coro *RunQueuePop(CoroSched *sched) {
+    Coro *coro = sched->run_head;
+    if (coro != NULL) {
+        sched->run_head = coro->next;
+        if (sched->run_head == NULL) { sched->run_tail = NULL; }
+    }
+    return coro;
+}
+
+static
+void TimerPush(CoroSched *sched, Coro *coro) {
+    int i = sched->num_timers++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (sched->timers[parent]->deadline <= coro->deadline) { break; }
+        sched->timers[i] = sched->timers[parent];
+        i = parent;
+    }
+    sched->timers[i] = coro;
+}
+
+static
+Coro *TimerPop(CoroSched *sched) {
+    Coro *top = sched->timers[0];
+    Coro *last = sched->timers[--sched->num_timers];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= sched->num_timers) { break; }
+        if (child + 1 < sched->num_timers &&
+            sched->timers[child + 1]->deadline < sched->timers[child]->deadline)
+        {
+            ++child;
+        }
+        if (last->deadline <= sched->timers[child]->deadline) { break; }
+        sched->timers[i] = sched->timers[child];
+        i = child;
+    }
+    if (sched->num_timers > 0) { sched->timers[i] = last; }
+    return top;
+}
+
+static
+void Trampoline() {
+    Coro *coro = current;
+    coro->func(coro->arg);
+    coro->state = CORO_DONE;
+    /* Returning resumes the scheduler through uc_link */
+}
+
+static
+void *SchedLoop(void *arg) {
+    CoroSched *sched = (CoroSched *) arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (sched->live > 0) {
+        /* Expired timers become runnable */
+        unsigned long now = NowMicros();
+        while (sched->num_timers > 0 && sched->timers[0]->deadline <= now) {
+            RunQueuePush(sched, TimerPop(sched));
+        }
+
+        Coro *coro = RunQueuePop(sched);
+        if (coro == NULL) {
+            if (sched->num_timers > 0) {
+                unsigned long deadline = sched->timers[0]->deadline;
+                struct timespec ts;
+                ts.tv_sec = deadline / 1000000UL;
+                ts.tv_nsec = (deadline % 1000000UL) * 1000UL;
+                pthread_cond_timedwait(&sched->cv, &sched->lock, &ts);
+            } else {
+                pthread_cond_wait(&sched->cv, &sched->lock);
+            }
+            continue;
+        }
+
+        coro->state = CORO_RUNNING;
+        ++sched->switches;
+        pthread_mutex_unlock(&sched->lock);
+        current = coro;
+        swapcontext(&sched->ctx, &coro->ctx);
+        current = NULL;
+        pthread_mutex_lock(&sched->lock);
+
+        if (coro->state == CORO_DONE) {
+            --sched->live;
+            munmap(coro->stack, CORO_STACK_SIZE);
+            coro->stack = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return (void *) 0;
+}
+
+int  CoroSchedInit(int num_threads) {
+    scheds = (CoroSched *) calloc(num_threads, sizeof(CoroSched));
+    if (scheds == NULL) { return FALSE; }
+    num_scheds = num_threads;
+    next_sched = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        scheds[i].lock = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+        scheds[i].cv = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+    }
+    coros = NULL;
+    num_coros = max_coros_total = 0;
+    return TRUE;
+}
+
+Coro *CoroCreate(void (*func)(void *), void *arg) {
+    Coro *coro = (Coro *) calloc(1, sizeof(Coro));
+    coro->stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (coro->stack == MAP_FAILED) {
+        free(coro);
+        return NULL;
+    }
+    coro->func = func;
+    coro->arg = arg;
+
+    CoroSched *sched = &scheds[next_sched];
+    next_sched = (next_sched + 1) % num_scheds;
+    coro->sched = sched;
+
+    getcontext(&coro->ctx);
+    coro->ctx.uc_stack.ss_sp = coro->stack;
+    coro->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    coro->ctx.uc_link = &sched->ctx;
+    makecontext(&coro->ctx, Trampoline, 0);
+
+    ++sched->live;
+    ++sched->max_coros;
+    RunQueuePush(sched, coro);
+
+    if (num_coros == max_coros_total) {
+        max_coros_total = (max_coros_total == 0) ? 64 : max_coros_total * 2;
+        coros = (Coro **) realloc(coros, max_coros_total * sizeof(Coro *));
+    }
+    coros[num_coros++] = coro;
+    return coro;
+}
+
+void CoroRunAll(void (*started)(pthread_t)) {
+    for (int i = 0; i < num_scheds; ++i) {
+        scheds[i].timers = (Coro **) malloc((scheds[i].max_coros + 1) *
+                                            sizeof(Coro *));
+        pthread_create(&scheds[i].thread, NULL, SchedLoop, &scheds[i]);
+        if (started != NULL) { started(scheds[i].thread); }
+    }
+    for (int i = 0; i < num_scheds; ++i) {
+        pthread_join(scheds[i].thread, NULL);
+    }
+}
+
+void CoroSchedFree() {
+    for (int i = 0; i < num_coros; ++i) {
+        if (coros[i]->stack != NULL) { munmap(coros[i]->stack, CORO_STACK_SIZE); }
+        free(coros[i]);
+    }
+    for (int i = 0; i < num_scheds; ++i) {
+        free(scheds[i].timers);
+    }
+    free(coros);
+    free(scheds);
+    coros = NULL;
+    scheds = NULL;
+    num_coros = max_coros_total = num_scheds = 0;
+}
+
+Coro *CoroSelf() {
+    return current;
+}
+
+void CoroPark(pthread_mutex_t *mut) {
+    /*
+     * Like pthread_cond_wait(): releases mut, suspends until CoroWake(),
+     * then reacquires mut.  A wake that lands between the unlock and the
+     * suspend is remembered in wake_pending rather than lost.
+     */
+    Coro *coro = current;
+    CoroSched *sched = coro->sched;
+
+    pthread_mutex_unlock(mut);
+    pthread_mutex_lock(&sched->lock);
+    if (coro->wake_pending) {
+        coro->wake_pending = FALSE;
+        pthread_mutex_unlock(&sched->lock);
+    } else {
+        coro->state = CORO_PARKED;
+        pthread_mutex_unlock(&sched->lock);
+        swapcontext(&coro->ctx, &sched->ctx);
+    }
+    pthread_mutex_lock(mut);
+}
+
+void CoroWake(Coro *coro) {
+    CoroSched *sched = coro->sched;
+    pthread_mutex_lock(&sched->lock);
+    if (coro->state == CORO_PARKED) {
+        RunQueuePush(sched, coro);
+        pthread_cond_signal(&sched->cv);
+    } else if (coro->state == CORO_RUNNING) {
+        coro->wake_pending = TRUE;
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void CoroSleepUntil(unsigned long deadline) {
+    /* Timer-suspended yield; the scheduler resumes us at the deadline */
+    Coro *coro = current;
+    CoroSched *sched = coro->sched;
+
+    pthread_mutex_lock(&sched->lock);
+    coro->state = CORO_SLEEPING;
+    coro->deadline = deadline;
+    TimerPush(sched, coro);
+    pthread_mutex_unlock(&sched->lock);
+    swapcontext(&coro->ctx, &sched->ctx);
+}
+
+unsigned long CoroSwitches() {
+    unsigned long total = 0UL;
+    for (int i = 0; i < num_scheds; ++i) {
+        total += scheds[i].switches;
+    }
+    return total;
+}
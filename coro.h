@@ -0,0 +1,33 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _CORO_H_
+#define _CORO_H_
+
+#include <pthread.h>
+
+#include "my_math.h"
+
+#define CORO_STACK_SIZE  (64 * 1024) /* reserved per coroutine, touched lazily */
+
+typedef struct tagCoro Coro;
+
+/*
+ * Stackful coroutines (ucontext) multiplexed on a few scheduler threads.
+ * Each coroutine stays on the scheduler thread it was assigned to, so only
+ * that thread ever resumes it.  Times are absolute gettimeofday()
+ * microseconds, matching GetTime() in qdisc.c.
+ */
+extern int  CoroSchedInit(int num_threads);
+extern Coro *CoroCreate(void (*func)(void *), void *arg);
+extern void CoroRunAll(void (*started)(pthread_t)); /* started may be NULL */
+extern void CoroSchedFree();
+
+extern Coro *CoroSelf();
+extern void CoroPark(pthread_mutex_t *mut);
+extern void CoroWake(Coro *coro);
+extern void CoroSleepUntil(unsigned long deadline);
+
+extern unsigned long CoroSwitches();
+
+#endif /*_CORO_H_*/
@@ -0,0 +1,58 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "my_math.h"
+
+#include "event_log.h"
+
+/* Writer state; callers serialize on the emulation mutex */
+static FILE *log_fp;
+static EventRecord *records;
+static int num_buffered;
+
+/* ----------------------- Utility Functions ----------------------- */
+
+static
+void EventLogFlush() {
+    if (num_buffered > 0) {
+        fwrite(records, sizeof(EventRecord), num_buffered, log_fp);
+        num_buffered = 0;
+    }
+}
+
+int  EventLogOpen(char *path, int num_servers) {
+    log_fp = fopen(path, "wb");
+    if (log_fp == NULL) { return FALSE; }
+    records = (EventRecord *) malloc(EVENT_LOG_BUFFERED * sizeof(EventRecord));
+    num_buffered = 0;
+
+    EventLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVENT_LOG_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(EventRecord);
+    header.num_servers = num_servers;
+    fwrite(&header, sizeof(header), 1, log_fp);
+    return TRUE;
+}
+
+void EventLogWrite(EventRecord *rec) {
+    records[num_buffered++] = *rec;
+    if (num_buffered == EVENT_LOG_BUFFERED) { EventLogFlush(); }
+}
+
+void EventLogClose() {
+    if (log_fp == NULL) { return; }
+    EventLogFlush();
+    fclose(log_fp);
+    free(records);
+    log_fp = NULL;
+    records = NULL;
+}
+
+int  EventLogEnabled() {
+    return (log_fp != NULL);
+}
@@ -0,0 +1,61 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _EVENT_LOG_H_
+#define _EVENT_LOG_H_
+
+#include <stdint.h>
+
+#include "my_math.h"
+
+#define EVENT_LOG_MAGIC  "TBFLOG1"
+#define EVENT_LOG_BUFFERED  4096 /* records buffered before each fwrite() */
+
+/* Event types */
+#define EV_EMULATION_BEGINS  1
+#define EV_PACKET_ARRIVES  2 /* value = inter-arrival time, aux = tokens */
+#define EV_PACKET_DROPPED  3
+#define EV_Q1_ENTER  4 /* aux = priority band */
+#define EV_Q1_LEAVE  5 /* value = time in Q1 */
+#define EV_Q2_ENTER  6 /* value = pacing hold (-pace), aux = priority band */
+#define EV_Q2_LEAVE  7 /* value = time in Q2 */
+#define EV_SERVICE_BEGIN  8 /* aux = requested service time (milliseconds) */
+#define EV_SERVICE_END  9 /* value = service time */
+#define EV_TOKEN_ARRIVES  10
+#define EV_TOKEN_DROPPED  11
+#define EV_PACKET_REMOVED  12 /* aux = 1 (Q1), 2 (Q2) or 3 (a later stage) */
+#define EV_SIGINT  13
+#define EV_EMULATION_ENDS  14
+#define EV_STAGE_ENTER  15
+#define EV_STAGE_LEAVE  16 /* value = time in the stage */
+
+/* File header, written once */
+typedef struct tagEventLogHeader {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t num_servers;
+} EventLogHeader;
+
+/*
+ * Fixed-size event record; times and durations are in microseconds,
+ * times relative to the start of the emulation.
+ */
+typedef struct tagEventRecord {
+    uint64_t time;
+    uint16_t type;
+    uint16_t stage; /* shaping stage 2 and up, 0 for Q1, Q2 and servers */
+    int32_t num; /* packet or token number */
+    int32_t server; /* 0 when not at a server */
+    int32_t q1_len;
+    int32_t q2_len;
+    int32_t bucket; /* tokens in the stage's bucket */
+    int32_t value;
+    int32_t aux;
+} EventRecord;
+
+extern int  EventLogOpen(char *path, int num_servers);
+extern void EventLogWrite(EventRecord *rec);
+extern void EventLogClose();
+extern int  EventLogEnabled();
+
+#endif /*_EVENT_LOG_H_*/
@@ -0,0 +1,98 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "my_math.h"
+
+#include "occupancy_log.h"
+
+/* Ring state */
+static FILE *log_fp;
+static int csv;
+static OccupancySample *ring;
+static unsigned long capacity;
+static unsigned long count; /* samples recorded so far */
+
+/* ----------------------- Utility Functions ----------------------- */
+
+int  OccupancyLogOpen(char *path, int size) {
+    /* The file is opened now so a bad path fails before the emulation */
+    size_t length = strlen(path);
+    csv = (length >= 4 && strcmp(path + length - 4, ".csv") == 0);
+    log_fp = fopen(path, csv ? "w" : "wb");
+    if (log_fp == NULL) { return FALSE; }
+    ring = (OccupancySample *) calloc(size, sizeof(OccupancySample));
+    if (ring == NULL) {
+        fclose(log_fp);
+        log_fp = NULL;
+        return FALSE;
+    }
+    capacity = (unsigned long) size;
+    count = 0UL;
+    return TRUE;
+}
+
+void OccupancyLogRecord(OccupancySample *sample) {
+    ring[count++ % capacity] = *sample;
+}
+
+int  OccupancyLogClose(unsigned long interval) {
+    if (log_fp == NULL) { return TRUE; }
+    unsigned long kept = min(count, capacity);
+    unsigned long first = count - kept;
+    int ok = TRUE;
+
+    if (csv) {
+        if (fprintf(log_fp, "time,q1_len,q2_len,bucket,busy\n") < 0) {
+            ok = FALSE;
+        }
+        for (unsigned long i = first; i < count && ok; ++i) {
+            OccupancySample *s = &ring[i % capacity];
+            if (fprintf(log_fp, "%.3f,%d,%d,%d,%d\n", s->time / 1000.0,
+                        s->q1_len, s->q2_len, s->bucket, s->busy) < 0)
+            {
+                ok = FALSE;
+            }
+        }
+    } else {
+        OccupancyHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OCCUPANCY_LOG_MAGIC, sizeof(header.magic));
+        header.record_size = sizeof(OccupancySample);
+        header.interval = (uint32_t) interval;
+        header.overwritten = first;
+        ok = (fwrite(&header, sizeof(header), 1, log_fp) == 1);
+
+        /* At most two contiguous runs: the ring's tail, then its head */
+        unsigned long start = first % capacity;
+        unsigned long run = min(kept, capacity - start);
+        if (ok && fwrite(&ring[start], sizeof(OccupancySample), run, log_fp) != run) {
+            ok = FALSE;
+        }
+        if (ok && kept > run &&
+            fwrite(ring, sizeof(OccupancySample), kept - run, log_fp) != kept - run)
+        {
+            ok = FALSE;
+        }
+    }
+    if (fclose(log_fp) != 0) { ok = FALSE; }
+    free(ring);
+    log_fp = NULL;
+    ring = NULL;
+    return ok;
+}
+
+int  OccupancyLogEnabled() {
+    return (log_fp != NULL);
+}
+
+unsigned long OccupancyLogCount() {
+    return count;
+}
+
+unsigned long OccupancyLogOverwritten() {
+    return (count > capacity) ? count - capacity : 0UL;
+}
@@ -0,0 +1,45 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _OCCUPANCY_LOG_H_
+#define _OCCUPANCY_LOG_H_
+
+#include <stdint.h>
+
+#include "my_math.h"
+
+#define OCCUPANCY_LOG_MAGIC  "TBFOCC1"
+#define OCCUPANCY_RING_SIZE  (1 << 18) /* samples kept, the oldest are overwritten */
+
+/* Binary file header, written once */
+typedef struct tagOccupancyHeader {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t interval; /* microseconds between samples */
+    uint64_t overwritten; /* samples lost to the ring wrapping */
+} OccupancyHeader;
+
+/* One snapshot of the queues; time is relative to the start of the emulation */
+typedef struct tagOccupancySample {
+    uint64_t time; /* microseconds */
+    int32_t q1_len;
+    int32_t q2_len;
+    int32_t bucket; /* tokens in the -r/-B bucket */
+    int32_t busy; /* servers with a packet in service */
+} OccupancySample;
+
+/*
+ * Samples go to a ring preallocated by OccupancyLogOpen(), so recording
+ * never allocates or writes to the file.  OccupancyLogClose() writes the
+ * ring out, oldest first, as CSV when the path ends in ".csv" and as
+ * binary (header, then records) otherwise.  Callers serialize on the
+ * emulation mutex.
+ */
+extern int  OccupancyLogOpen(char *path, int capacity);
+extern void OccupancyLogRecord(OccupancySample *sample);
+extern int  OccupancyLogClose(unsigned long interval);
+extern int  OccupancyLogEnabled();
+extern unsigned long OccupancyLogCount(); /* samples taken, overwritten included */
+extern unsigned long OccupancyLogOverwritten();
+
+#endif /*_OCCUPANCY_LOG_H_*/
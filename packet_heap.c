@@ -0,0 +1,77 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "my_math.h"
+
+#include "packet_heap.h"
+
+/* ----------------------- Utility Functions ----------------------- */
+
+static
+int Before(PacketHeap *heap, int a, int b) {
+    /* TRUE if packet a leaves before packet b */
+    if (heap->keys[a] != heap->keys[b]) { return heap->keys[a] < heap->keys[b]; }
+    return a < b;
+}
+
+int  PacketHeapInit(PacketHeap *heap, int capacity, unsigned long *keys) {
+    memset(heap, 0, sizeof(PacketHeap));
+    heap->nums = (int *) malloc(((size_t) capacity + 1) * sizeof(int));
+    if (heap->nums == NULL) { return FALSE; }
+    heap->capacity = capacity;
+    heap->keys = keys;
+    return TRUE;
+}
+
+void PacketHeapFree(PacketHeap *heap) {
+    free(heap->nums);
+    memset(heap, 0, sizeof(PacketHeap));
+}
+
+int  PacketHeapLength(PacketHeap *heap) {
+    return heap->count;
+}
+
+int  PacketHeapPush(PacketHeap *heap, int num) {
+    if (heap->count == heap->capacity) { return FALSE; }
+
+    int i = heap->count++;
+    while (i > 0) { /* sift up */
+        int parent = (i - 1) / 2;
+        if (!Before(heap, num, heap->nums[parent])) { break; }
+        heap->nums[i] = heap->nums[parent];
+        i = parent;
+    }
+    heap->nums[i] = num;
+    return TRUE;
+}
+
+int  PacketHeapTop(PacketHeap *heap) {
+    return (heap->count > 0) ? heap->nums[0] : 0;
+}
+
+int  PacketHeapPop(PacketHeap *heap) {
+    if (heap->count == 0) { return 0; }
+
+    int top = heap->nums[0];
+    int last = heap->nums[--heap->count];
+    int i = 0;
+    for (;;) { /* sift the last entry down from the root */
+        int child = 2 * i + 1;
+        if (child >= heap->count) { break; }
+        if (child + 1 < heap->count &&
+            Before(heap, heap->nums[child + 1], heap->nums[child]))
+        {
+            ++child;
+        }
+        if (!Before(heap, heap->nums[child], last)) { break; }
+        heap->nums[i] = heap->nums[child];
+        i = child;
+    }
+    heap->nums[i] = last;
+    return top;
+}
@@ -0,0 +1,29 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _PACKET_HEAP_H_
+#define _PACKET_HEAP_H_
+
+#include "my_math.h"
+
+/*
+ * Binary min-heap of packet numbers ordered by a per-packet key column
+ * (e.g. PacketStore.departure_due), ties broken by packet number so equal
+ * keys leave in arrival order.  The key column is not owned by the heap
+ * and must not change while the packet is in it.
+ */
+typedef struct tagPacketHeap {
+    int *nums; /* nums[0] has the smallest key */
+    int count;
+    int capacity;
+    unsigned long *keys; /* indexed by packet number */
+} PacketHeap;
+
+extern int  PacketHeapInit(PacketHeap*, int capacity, unsigned long *keys);
+extern void PacketHeapFree(PacketHeap*);
+extern int  PacketHeapLength(PacketHeap*);
+extern int  PacketHeapPush(PacketHeap*, int num);
+extern int  PacketHeapTop(PacketHeap*); /* 0 when empty */
+extern int  PacketHeapPop(PacketHeap*); /* 0 when empty */
+
+#endif /*_PACKET_HEAP_H_*/
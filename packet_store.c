@@ -0,0 +1,147 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "my_math.h"
+
+#include "packet_store.h"
+
+/* ----------------------- Utility Functions ----------------------- */
+
+int  PacketStoreInit(PacketStore *store, int capacity) {
+    size_t rows = (size_t) capacity + 1; /* packet numbers start at 1 */
+    memset(store, 0, sizeof(PacketStore));
+    store->capacity = capacity;
+
+    store->inter_arrival_requested = (int *) calloc(rows, sizeof(int));
+    store->tokens_required = (int *) calloc(rows, sizeof(int));
+    store->service_time_requested = (int *) calloc(rows, sizeof(int));
+
+    store->inter_arrival_time = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->arrival = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->q1_enter = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->q1_leave = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->q2_enter = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->q2_leave = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->service_begin = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->service_end = (unsigned long *) calloc(rows, sizeof(unsigned long));
+    store->server = (int *) calloc(rows, sizeof(int));
+    store->fate = (unsigned char *) calloc(rows, sizeof(unsigned char));
+    store->band = (unsigned char *) calloc(rows, sizeof(unsigned char));
+    store->next = (int *) calloc(rows, sizeof(int));
+
+    store->departure_due = (unsigned long *) calloc(rows, sizeof(unsigned long));
+
+    store->slot = (int *) malloc(rows * sizeof(int));
+    store->length = (int *) calloc(rows, sizeof(int));
+
+    if (store->inter_arrival_requested == NULL ||
+        store->tokens_required == NULL ||
+        store->service_time_requested == NULL ||
+        store->inter_arrival_time == NULL || store->arrival == NULL ||
+        store->q1_enter == NULL || store->q1_leave == NULL ||
+        store->q2_enter == NULL || store->q2_leave == NULL ||
+        store->service_begin == NULL || store->service_end == NULL ||
+        store->server == NULL || store->fate == NULL || store->band == NULL ||
+        store->next == NULL ||
+        store->departure_due == NULL ||
+        store->slot == NULL || store->length == NULL)
+    {
+        PacketStoreFree(store);
+        return FALSE;
+    }
+    memset(store->slot, 0xff, rows * sizeof(int)); /* every slot is -1 */
+    return TRUE;
+}
+
+void PacketStoreFree(PacketStore *store) {
+    free(store->inter_arrival_requested);
+    free(store->tokens_required);
+    free(store->service_time_requested);
+    free(store->inter_arrival_time);
+    free(store->arrival);
+    free(store->q1_enter);
+    free(store->q1_leave);
+    free(store->q2_enter);
+    free(store->q2_leave);
+    free(store->service_begin);
+    free(store->service_end);
+    free(store->server);
+    free(store->fate);
+    free(store->band);
+    free(store->next);
+    free(store->departure_due);
+    free(store->slot);
+    free(store->length);
+    memset(store, 0, sizeof(PacketStore));
+}
+
+void PacketStorePrefault(PacketStore *store) {
+    /*
+     * calloc() hands back untouched zero pages; write the zeros so the
+     * first packets do not take page faults.  slot is already written.
+     */
+    size_t rows = (size_t) store->capacity + 1;
+    memset(store->inter_arrival_requested, 0, rows * sizeof(int));
+    memset(store->tokens_required, 0, rows * sizeof(int));
+    memset(store->service_time_requested, 0, rows * sizeof(int));
+    memset(store->inter_arrival_time, 0, rows * sizeof(unsigned long));
+    memset(store->arrival, 0, rows * sizeof(unsigned long));
+    memset(store->q1_enter, 0, rows * sizeof(unsigned long));
+    memset(store->q1_leave, 0, rows * sizeof(unsigned long));
+    memset(store->q2_enter, 0, rows * sizeof(unsigned long));
+    memset(store->q2_leave, 0, rows * sizeof(unsigned long));
+    memset(store->service_begin, 0, rows * sizeof(unsigned long));
+    memset(store->service_end, 0, rows * sizeof(unsigned long));
+    memset(store->server, 0, rows * sizeof(int));
+    memset(store->fate, 0, rows * sizeof(unsigned char));
+    memset(store->band, 0, rows * sizeof(unsigned char));
+    memset(store->next, 0, rows * sizeof(int));
+    memset(store->departure_due, 0, rows * sizeof(unsigned long));
+    memset(store->length, 0, rows * sizeof(int));
+}
+
+int  PacketStoreExport(PacketStore *store, FILE *fp, unsigned long begin) {
+    /* One CSV row per packet; times in milliseconds since begin */
+    static char *fates[] = { "pending", "served", "dropped", "removed" };
+    fprintf(fp, "packet,fate,tokens,inter_arrival,arrival,q1_enter,q1_leave,"
+            "q2_enter,q2_leave,service_begin,service_end,server,band\n");
+    for (int i = 1; i <= store->capacity; ++i) {
+        if (store->arrival[i] == 0) { continue; } /* never arrived */
+        fprintf(fp, "%d,%s,%d,%.3f", i, fates[store->fate[i]],
+                store->tokens_required[i],
+                store->inter_arrival_time[i] / 1000.0);
+        unsigned long *columns[] = {
+            store->arrival, store->q1_enter, store->q1_leave,
+            store->q2_enter, store->q2_leave,
+            store->service_begin, store->service_end
+        };
+        for (int c = 0; c < 7; ++c) {
+            if (columns[c][i] == 0) {
+                fprintf(fp, ",");
+            } else {
+                fprintf(fp, ",%.3f", (columns[c][i] - begin) / 1000.0);
+            }
+        }
+        fprintf(fp, ",%d,%d\n", store->server[i], store->band[i]);
+    }
+    return !ferror(fp);
+}
+
+long PacketStoreDurations(PacketStore *store, unsigned long *valid,
+                          unsigned long *end, unsigned long *begin,
+                          double *out) {
+    /*
+     * Compacts end - begin (or end alone when begin is NULL) for every row
+     * whose valid column is set into out, without branching per row.
+     */
+    long count = 0;
+    for (int i = 1; i <= store->capacity; ++i) {
+        out[count] = (double) (end[i] - (begin ? begin[i] : 0UL));
+        count += (valid[i] != 0);
+    }
+    return count;
+}
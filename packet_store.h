@@ -0,0 +1,59 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _PACKET_STORE_H_
+#define _PACKET_STORE_H_
+
+#include <stdio.h>
+
+#include "my_math.h"
+
+/* Packet fates */
+#define FATE_PENDING  0
+#define FATE_SERVED  1
+#define FATE_DROPPED  2
+#define FATE_REMOVED  3
+
+/*
+ * Columnar packet records, preallocated for the whole run and indexed by
+ * packet number (1 through capacity).  Every stage timestamp has its own
+ * column, so nothing is overwritten as a packet moves through the system
+ * and all timings remain available once the emulation ends.  Times are in
+ * microseconds.
+ */
+typedef struct tagPacketStore {
+    int capacity;
+
+    /* Requested by the tsfile or commandline */
+    int *inter_arrival_requested; /* milliseconds */
+    int *tokens_required;
+    int *service_time_requested; /* milliseconds */
+
+    /* Measured */
+    unsigned long *inter_arrival_time;
+    unsigned long *arrival;
+    unsigned long *q1_enter, *q1_leave;
+    unsigned long *q2_enter, *q2_leave;
+    unsigned long *service_begin, *service_end;
+    int *server;
+    unsigned char *fate;
+    unsigned char *band; /* priority band, 0 is served first */
+    int *next; /* next packet in the same Q1/Q2 FIFO (see prio_queue.h) */
+
+    /* EDT pacing mode */
+    unsigned long *departure_due; /* earliest departure time */
+
+    /* UDP shaping mode */
+    int *slot; /* payload slot, -1 for synthetic packets */
+    int *length; /* payload bytes */
+} PacketStore;
+
+extern int  PacketStoreInit(PacketStore*, int capacity);
+extern void PacketStoreFree(PacketStore*);
+extern void PacketStorePrefault(PacketStore*);
+extern int  PacketStoreExport(PacketStore*, FILE *fp, unsigned long begin);
+extern long PacketStoreDurations(PacketStore*, unsigned long *valid,
+                                 unsigned long *end, unsigned long *begin,
+                                 double *out);
+
+#endif /*_PACKET_STORE_H_*/
@@ -0,0 +1,78 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "my_math.h"
+
+#include "prio_queue.h"
+
+/* ----------------------- Utility Functions ----------------------- */
+
+void PacketFifoInit(PacketFifo *fifo) {
+    fifo->head = fifo->tail = 0;
+    fifo->length = 0;
+}
+
+void PacketFifoAppend(PacketFifo *fifo, int *links, int num) {
+    links[num] = 0;
+    if (fifo->tail == 0) {
+        fifo->head = num;
+    } else {
+        links[fifo->tail] = num;
+    }
+    fifo->tail = num;
+    ++fifo->length;
+}
+
+int  PacketFifoPop(PacketFifo *fifo, int *links) {
+    int num = fifo->head;
+    if (num == 0) { return 0; }
+    fifo->head = links[num];
+    if (fifo->head == 0) { fifo->tail = 0; }
+    --fifo->length;
+    return num;
+}
+
+int  PrioQueueInit(PrioQueue *queue, int *links) {
+    for (int b = 0; b < PRIO_BANDS; ++b) {
+        PacketFifoInit(&queue->bands[b]);
+    }
+    queue->occupied = 0;
+    queue->length = 0;
+    queue->links = links;
+    return TRUE;
+}
+
+int  PrioQueueLength(PrioQueue *queue) {
+    return queue->length;
+}
+
+int  PrioQueueEmpty(PrioQueue *queue) {
+    return queue->occupied == 0;
+}
+
+int  PrioQueueAppend(PrioQueue *queue, int num, int band) {
+    PacketFifoAppend(&queue->bands[band], queue->links, num);
+    queue->occupied |= (uint64_t) 1 << band;
+    ++queue->length;
+    return TRUE;
+}
+
+int  PrioQueueFirst(PrioQueue *queue) {
+    if (queue->occupied == 0) { return 0; }
+    return queue->bands[__builtin_ctzll(queue->occupied)].head;
+}
+
+int  PrioQueuePop(PrioQueue *queue) {
+    if (queue->occupied == 0) { return 0; }
+    int b = __builtin_ctzll(queue->occupied);
+    int num = PacketFifoPop(&queue->bands[b], queue->links);
+    if (queue->bands[b].length == 0) {
+        queue->occupied &= ~((uint64_t) 1 << b);
+    }
+    --queue->length;
+    return num;
+}
@@ -0,0 +1,46 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _PRIO_QUEUE_H_
+#define _PRIO_QUEUE_H_
+
+#include <stdint.h>
+
+#include "my_math.h"
+
+#define PRIO_BANDS  64 /* band 0 is served first */
+
+/*
+ * FIFO of packet numbers linked through a preallocated column indexed by
+ * packet number (PacketStore.next), so queueing never allocates.  A packet
+ * can be in at most one queue sharing that column at a time.
+ */
+typedef struct tagPacketFifo {
+    int head, tail; /* packet numbers, 0 when empty */
+    int length;
+} PacketFifo;
+
+extern void PacketFifoInit(PacketFifo*);
+extern void PacketFifoAppend(PacketFifo*, int *links, int num);
+extern int  PacketFifoPop(PacketFifo*, int *links); /* 0 when empty */
+
+/*
+ * Strict-priority queue of packet numbers: one FIFO per band plus an
+ * occupancy bitmap, so the first non-empty band is found with a single
+ * count-trailing-zeros instead of a scan.
+ */
+typedef struct tagPrioQueue {
+    PacketFifo bands[PRIO_BANDS];
+    uint64_t occupied; /* bit b set while bands[b] is non-empty */
+    int length;
+    int *links; /* next packet in the same band, indexed by packet number */
+} PrioQueue;
+
+extern int  PrioQueueInit(PrioQueue*, int *links);
+extern int  PrioQueueLength(PrioQueue*);
+extern int  PrioQueueEmpty(PrioQueue*);
+extern int  PrioQueueAppend(PrioQueue*, int num, int band);
+extern int  PrioQueueFirst(PrioQueue*); /* 0 when empty */
+extern int  PrioQueuePop(PrioQueue*); /* 0 when empty */
+
+#endif /*_PRIO_QUEUE_H_*/
@@ -0,0 +1,47 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * USDT probes under the "qdisc" provider.  With systemtap's sys/sdt.h
+ * (the Makefile then passes -DHAVE_SYS_SDT_H) each probe is a single nop
+ * until a tracer attaches, e.g.
+ *
+ *     bpftrace -e 'usdt:./qdisc:qdisc:q1__leave { @q1_us = hist(arg1); }'
+ *
+ * Without it they compile to nothing.  Times are in microseconds.
+ *
+ *     packet__arrive  (packet, tokens needed, inter-arrival time)
+ *     packet__drop    (packet)
+ *     q1__enter       (packet, band)
+ *     q1__leave       (packet, time in Q1)
+ *     token__arrive   (token, tokens in the bucket)
+ *     token__drop     (token)
+ *     q2__enter       (packet, band)
+ *     q2__leave       (packet, time in Q2)
+ *     service__begin  (packet, server, requested service in milliseconds)
+ *     service__end    (packet, server, service time)
+ *     mut__lock       ()  about to lock the emulation mutex
+ *     mut__acquired   ()  holds it; the gap from mut__lock is the wait
+ */
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define QDISC_PROBE0(name)  DTRACE_PROBE(qdisc, name)
+#define QDISC_PROBE1(name, a)  DTRACE_PROBE1(qdisc, name, a)
+#define QDISC_PROBE2(name, a, b)  DTRACE_PROBE2(qdisc, name, a, b)
+#define QDISC_PROBE3(name, a, b, c)  DTRACE_PROBE3(qdisc, name, a, b, c)
+
+#else /* ~HAVE_SYS_SDT_H */
+
+#define QDISC_PROBE0(name)  do { } while (0)
+#define QDISC_PROBE1(name, a)  do { } while (0)
+#define QDISC_PROBE2(name, a, b)  do { } while (0)
+#define QDISC_PROBE3(name, a, b, c)  do { } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /*_PROBES_H_*/
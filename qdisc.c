@@ -5,15 +5,34 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <math.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
 #include <limits.h>
+#include <sys/resource.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#endif /* __linux__ */
 
 #include "my_math.h"
 
-#include "my_list.h"
+#include "udp_io.h"
+#include "event_log.h"
+#include "packet_store.h"
+#include "stats_kernels.h"
+#include "coro.h"
+#include "stage_queue.h"
+#include "packet_heap.h"
+#include "prio_queue.h"
+#include "realtime.h"
+#include "occupancy_log.h"
+#include "probes.h"
 
 /* Constants */
 #define MIC_TO_MIL  1000 
@@ -27,28 +46,101 @@
 #define ASCII_SPACE  32
 #define ASCII_ZERO  48
 #define ASCII_NINE  57
-
-/* Packet Data Structure */
-typedef struct tagPacket { 
+#define BATCH_HIST_BUCKETS  16 /* power-of-two buckets: 1, 2-3, 4-7, ... */
+#define SPIN_THRESHOLD  200UL /* microseconds spun out instead of slept */
+#define SYSTEM_HIST_BUCKETS  10
+#define MAX_LISTED_SERVERS  64 /* beyond this, server occupancy is summarized */
+#define PACE_CHECK  100000UL /* microseconds a pacing server sleeps between checks */
+#define STEAL_NONE  0 /* one shared Q2 */
+#define STEAL_RR  1 /* per-server queues, filled round-robin */
+#define STEAL_LEAST  2 /* per-server queues, filled least-loaded first */
+#define RT_PRIORITY_TIMER  60 /* SCHED_FIFO for packet, token and stage threads */
+#define RT_PRIORITY_SERVER  55 /* SCHED_FIFO for server and coroutine threads */
+#define COST_PACKET_ARRIVES  0 /* -cost counters, one per event function */
+#define COST_Q1_ENTER  1
+#define COST_Q1_LEAVE  2
+#define COST_TOKEN_ARRIVES  3
+#define COST_Q2_ENTER  4
+#define COST_Q2_LEAVE  5
+#define COST_SERVICE_BEGIN  6
+#define COST_SERVICE_END  7
+#define COST_EVENTS  8
+
+/* Server Data Structure */
+typedef struct tagServerSlot {
     int num;
-    int inter_arrival_time; /* milliseconds */
-    int tokens_required;
-    int service_time_requested; /* milliseconds */
-    unsigned long arrival_time; /* microseconds */
-    unsigned long enter_time; /* microseconds */
-    unsigned long leave_time; /* microseconds */
-} Packet;
+    int idle; /* TRUE = parked on the idle-server stack */
+    int idle_pos; /* index in idle_stack[] while idle */
+    pthread_t thread;
+    pthread_cond_t cv; /* private wait slot, signalled only for this server */
+    Coro *coro; /* set when the server is a coroutine instead of a thread */
+    unsigned long total_time; /* microseconds spent serving */
+
+    /* Work-stealing only */
+    PacketFifo local_q; /* this server's part of Q2 */
+    unsigned long steals; /* packets taken from other servers' queues */
+
+    /* Event-loop runtime only */
+    int timer_fd; /* fires when the packet in service completes */
+    int *batch; /* packets claimed from Q2 */
+    int claimed, next; /* batch[next] is in service while next < claimed */
+    unsigned long service_due;
+} ServerSlot;
+
+/* Scheduling Drift Data Structure (actual minus intended event time) */
+typedef struct tagDrift {
+    unsigned long count;
+    double total; /* microseconds */
+    long worst; /* microseconds */
+    double total_sqr; /* for the jitter (standard deviation) */
+} Drift;
+
+/* Cost Counter Data Structure (-cost) */
+typedef struct tagCost {
+    unsigned long count;
+    unsigned long total; /* nanoseconds */
+    unsigned long worst; /* nanoseconds */
+} Cost;
+
+/* Shaping Stage Data Structure (stage 1 is Q1 and the -r/-B bucket) */
+typedef struct tagStage {
+    int num; /* 2 and up */
+    double rate; /* tokens per second */
+    long B;
+    double r; /* real microseconds between tokens, not rounded */
+    int bucket;
+    pthread_t thread;
+    StageQueue queue; /* filled by the previous stage */
+    int done; /* TRUE once no packet will leave this stage again */
+    int accepted_tokens, dropped_tokens;
+    StatsSummary latency; /* microseconds from entering to leaving */
+} Stage;
 
 /* ----------------------- Global Variables ----------------------- */
 pthread_mutex_t mut;
-pthread_cond_t cv;
-pthread_t packet_thread, token_thread, server_one_thread, server_two_thread;
+pthread_t packet_thread, token_thread;
 pthread_t signal_thread;
+pthread_t sample_thread;
+pthread_cond_t sample_cv; /* signalled to stop the sampler */
+int sampling_done; /* TRUE = the sampler should return */
 sigset_t set;
 
 /* Shared Variables */
-MyList Q1, Q2;
+PacketStore pkts; /* every packet's record, indexed by packet number */
+PrioQueue Q1, Q2; /* one FIFO per priority band */
 int token_bucket;
+int busy_servers; /* servers with a packet in service */
+ServerSlot *servers;
+int *idle_stack; /* indices into servers[], top is most recently idle */
+int idle_top;
+int q2_packets; /* packets in all local queues when work-stealing */
+int next_server; /* round-robin cursor into servers[] */
+Stage *stages; /* shaping stages after the first, in order */
+int num_stages;
+int in_pipeline; /* packets held in stages[] */
+PacketHeap Q2_heap; /* Q2 ordered by departure time when pacing */
+double pace_next; /* earliest departure time of the next packet */
+uint64_t bands_seen; /* bit b set once a packet in band b was read */
 
 /* Commandline options */
 long n;
@@ -57,12 +149,30 @@ double mu;
 double rate;
 long B;
 long P;
+long num_servers;
+double speed; /* time-scale factor applied to every scheduled delay */
+int event_loop; /* TRUE = single-threaded epoll runtime */
+long coro_threads; /* > 0 = servers are coroutines on this many threads */
+long batch_max; /* most packets a server may claim from Q2 at once */
+int steal_policy; /* STEAL_NONE, STEAL_RR or STEAL_LEAST */
+int edt_pacing; /* TRUE = earliest-departure-time pacing instead of tokens */
+int cost_counters; /* TRUE = time the event functions and waits on mut */
+int rt_cpus[RT_MAX_CPUS]; /* -rt: threads are pinned round-robin over these */
+int rt_num_cpus; /* 0 = default scheduling */
+int udp_in_port, udp_out_port; /* 0 = synthetic packets */
+int udp_fd;
+char trace_path[1026]; /* binary event log, empty = disabled */
+char export_path[1026]; /* per-packet CSV export, empty = disabled */
+char sample_path[1026]; /* occupancy time series, empty = disabled */
+double sample_ms; /* trace-time milliseconds between occupancy samples */
 char buf[1026];
 
 /* Rates converted to times in milliseconds */
 unsigned long l; /* inter-arrival time */
-unsigned long r; /* inter-token-arrival time */
+double r; /* real microseconds between tokens (-speed applied), not rounded */
 unsigned long m; /* service time */
+double pace_interval; /* microseconds per token when pacing, not rounded */
+unsigned long sample_interval; /* real microseconds between occupancy samples */
 
 unsigned long current_time;
 unsigned long emulation_begin, emulation_end;
@@ -71,12 +181,36 @@ int time_to_quit; /* TRUE = signal <Ctrl-c> pressed */
 int completed_packets, dropped_packets, removed_packets;
 int accepted_tokens, dropped_tokens;
 
-/* microseconds for precision */
-int avg_inter_arrival_time;
-int avg_service_time;
-unsigned long total_Q1_time, total_Q2_time, total_S1_time, total_S2_time;
+/* Post-run reductions over the packet store (microseconds) */
+StatsSummary inter_arrival_stats, service_stats, system_stats;
+StatsSummary Q1_stats, Q2_stats;
+long system_hist[SYSTEM_HIST_BUCKETS];
+double reduction_time; /* milliseconds spent in the kernels */
+
+/* Batch size histograms */
+int transfer_batches[BATCH_HIST_BUCKETS]; /* Q1 -> Q2 moves per CheckQ1() */
+int claim_batches[BATCH_HIST_BUCKETS]; /* Q2 packets claimed per server lock */
+
+/* Wakeup accounting */
+unsigned long wakeups_issued; /* condition signals, one futex wake each */
+unsigned long wasted_wakeups; /* woken servers that found no work */
+struct rusage usage_begin, usage_end;
+
+/* Scheduling accuracy */
+Drift arrival_drift, token_drift, service_drift, pace_drift;
 
-double avg_x, avg_x_sqr; /* milliseconds */
+/* Output smoothness (microseconds between successive departures) */
+StatsSummary departure_stats;
+unsigned long last_departure; /* 0 = nothing has departed yet */
+
+/* Cost counters, updated while holding mut */
+Cost event_costs[COST_EVENTS];
+Cost mut_wait; /* contended acquisitions only */
+unsigned long mut_acquisitions;
+
+/* Real-time setup results */
+int rt_threads, rt_pinned, rt_fifo; /* threads attempted, pinned, SCHED_FIFO */
+int rt_locked; /* TRUE = mlockall() succeeded */
 
 /* ----------------------- Utility Functions ----------------------- */
 
@@ -103,12 +237,45 @@ void MalformedCommandline(int flag) {
         case 7: /* t error */
             fprintf(stderr, "malformed commandline - argument missing for t\n");
             break;
+        case 8: /* batch error */
+            fprintf(stderr, "malformed commandline - argument missing for batch\n");
+            break;
+        case 9: /* s error */
+            fprintf(stderr, "malformed commandline - argument missing for s\n");
+            break;
+        case 10: /* udp error */
+            fprintf(stderr, "malformed commandline - argument missing for udp\n");
+            break;
+        case 11: /* trace error */
+            fprintf(stderr, "malformed commandline - argument missing for trace\n");
+            break;
+        case 12: /* speed error */
+            fprintf(stderr, "malformed commandline - argument missing for speed\n");
+            break;
+        case 13: /* export error */
+            fprintf(stderr, "malformed commandline - argument missing for export\n");
+            break;
+        case 14: /* coro error */
+            fprintf(stderr, "malformed commandline - argument missing for coro\n");
+            break;
+        case 15: /* steal error */
+            fprintf(stderr, "malformed commandline - argument missing for steal\n");
+            break;
+        case 16: /* stage error */
+            fprintf(stderr, "malformed commandline - argument missing for stage\n");
+            break;
+        case 17: /* rt error */
+            fprintf(stderr, "malformed commandline - argument missing for rt\n");
+            break;
+        case 18: /* sample error */
+            fprintf(stderr, "malformed commandline - argument missing for sample\n");
+            break;
         default: /* unknown flag used */
             fprintf(stderr, "malformed commandline - unknown flag used\n");
             break;
     }
     fprintf(stderr, 
-            "usage: qdisc [-lambda lambda] [-mu mu] [-r r] [-B B] [-P P] [-n num] [-t tsfile]\n");
+            "usage: qdisc [-lambda lambda] [-mu mu] [-r r] [-B B] [-P P] [-n num] [-t tsfile] [-batch k] [-s servers] [-udp in_port:out_port] [-trace file] [-speed X] [-export csvfile] [-epoll] [-coro threads] [-steal rr|least] [-stage r:B] [-pace] [-rt cpulist] [-sample ms:file] [-cost]\n");
     exit(1);
 }
 
@@ -120,13 +287,38 @@ void Init() {
     rate = 1.5;
     B = 10;
     P = 3;
+    batch_max = 1;
+    num_servers = 2;
+    speed = 1.0;
+    event_loop = FALSE;
+    coro_threads = 0;
+    steal_policy = STEAL_NONE;
+    edt_pacing = FALSE;
+    cost_counters = FALSE;
+    rt_num_cpus = 0;
+    udp_in_port = udp_out_port = 0;
+    udp_fd = -1;
+    *trace_path = '\0';
+    *export_path = '\0';
+    *buf = '\0';
+    *sample_path = '\0';
+    sample_ms = 0.0;
 
     mut = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-    cv = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
-
-    MyListInit(&Q1);
-    MyListInit(&Q2);
+    sample_cv = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+    sampling_done = FALSE;
+
+    PrioQueueInit(&Q1, NULL); /* linked through pkts.next once it exists */
+    PrioQueueInit(&Q2, NULL);
+    q2_packets = 0;
+    next_server = 0;
+    stages = NULL;
+    num_stages = 0;
+    in_pipeline = 0;
+    pace_next = 0.0;
+    bands_seen = 1; /* everything is band 0 without a 4th tsfile column */
     token_bucket = 0;
+    busy_servers = 0;
 
     current_time = 0UL;
     emulation_begin = emulation_end = 0UL;
@@ -135,14 +327,40 @@ void Init() {
     completed_packets = dropped_packets = removed_packets = 0;
     accepted_tokens = dropped_tokens = 0;
 
-    avg_inter_arrival_time = 0;
-    avg_service_time = 0;
-    total_Q1_time = total_Q2_time = total_S1_time = total_S2_time = 0UL;
-    avg_x = 0UL;
-    avg_x_sqr = 0UL;
+    memset(transfer_batches, 0, sizeof(transfer_batches));
+    memset(claim_batches, 0, sizeof(claim_batches));
+    wakeups_issued = wasted_wakeups = 0UL;
+    memset(&arrival_drift, 0, sizeof(Drift));
+    memset(&token_drift, 0, sizeof(Drift));
+    memset(&service_drift, 0, sizeof(Drift));
+    memset(&pace_drift, 0, sizeof(Drift));
+    memset(&departure_stats, 0, sizeof(StatsSummary));
+    last_departure = 0UL;
+    rt_threads = rt_pinned = rt_fifo = 0;
+    rt_locked = FALSE;
+    memset(event_costs, 0, sizeof(event_costs));
+    memset(&mut_wait, 0, sizeof(Cost));
+    mut_acquisitions = 0UL;
+}
+
+void InitServers() {
+    servers = (ServerSlot *) malloc(num_servers * sizeof(ServerSlot));
+    idle_stack = (int *) malloc(num_servers * sizeof(int));
+    idle_top = 0;
+    for (int i = 0; i < num_servers; ++i) {
+        servers[i].num = i + 1;
+        servers[i].idle = FALSE;
+        servers[i].cv = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+        servers[i].total_time = 0UL;
+        servers[i].coro = NULL;
+        PacketFifoInit(&servers[i].local_q);
+        servers[i].steals = 0UL;
+        servers[i].timer_fd = -1;
+        servers[i].batch = NULL;
+        servers[i].claimed = servers[i].next = 0;
+    }
 }
 
-static
 void ProcessOptions(int argc, char *argv[]) {
     for (--argc, ++argv; argc > 0; --argc, ++argv) {
         if (*argv[0] == '-') {
@@ -208,6 +426,129 @@ void ProcessOptions(int argc, char *argv[]) {
                     MalformedCommandline(7);
                 }
                 strcpy(buf, *argv);
+            } else if (strcmp(*argv, "-batch") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(8);
+                }
+                batch_max = strtol(*argv, 0, 10);
+                if (batch_max > INT_MAX) {
+                    fprintf(stderr, "error in the input - batch is too large\n");
+                    exit(1);
+                } else if (batch_max <= 0) {
+                    fprintf(stderr, "error in the input - batch is not positive\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-s") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(9);
+                }
+                num_servers = strtol(*argv, 0, 10);
+                if (num_servers > INT_MAX) {
+                    fprintf(stderr, "error in the input - s is too large\n");
+                    exit(1);
+                } else if (num_servers <= 0) {
+                    fprintf(stderr, "error in the input - s is not positive\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-udp") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(10);
+                }
+                if (sscanf(*argv, "%d:%d", &udp_in_port, &udp_out_port) != 2 ||
+                    udp_in_port <= 0 || udp_in_port > 65535 ||
+                    udp_out_port <= 0 || udp_out_port > 65535)
+                {
+                    fprintf(stderr,
+                            "error in the input - udp is not in_port:out_port\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-speed") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(12);
+                }
+                speed = strtod(*argv, NULL);
+                if (speed <= 0) {
+                    fprintf(stderr, "error in the input - speed is not positive\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-epoll") == 0) {
+                event_loop = TRUE;
+                ++argc; /* takes no argument */
+            } else if (strcmp(*argv, "-pace") == 0) {
+                edt_pacing = TRUE;
+                ++argc; /* takes no argument */
+            } else if (strcmp(*argv, "-cost") == 0) {
+                cost_counters = TRUE;
+                ++argc; /* takes no argument */
+            } else if (strcmp(*argv, "-coro") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(14);
+                }
+                coro_threads = strtol(*argv, 0, 10);
+                if (coro_threads > INT_MAX) {
+                    fprintf(stderr, "error in the input - coro is too large\n");
+                    exit(1);
+                } else if (coro_threads <= 0) {
+                    fprintf(stderr, "error in the input - coro is not positive\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-steal") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(15);
+                }
+                if (strcmp(*argv, "rr") == 0) {
+                    steal_policy = STEAL_RR;
+                } else if (strcmp(*argv, "least") == 0) {
+                    steal_policy = STEAL_LEAST;
+                } else {
+                    fprintf(stderr, "error in the input - steal is not rr or least\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-rt") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(17);
+                }
+                rt_num_cpus = RealtimeParseCpus(*argv, rt_cpus, RT_MAX_CPUS);
+                if (rt_num_cpus == 0) {
+                    fprintf(stderr, "error in the input - rt is not a cpu list\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-stage") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(16);
+                }
+                stages = (Stage *) realloc(stages,
+                                           (num_stages + 1) * sizeof(Stage));
+                Stage *stage = &stages[num_stages++];
+                memset(stage, 0, sizeof(Stage));
+                stage->num = num_stages + 1;
+                if (sscanf(*argv, "%lf:%ld", &stage->rate, &stage->B) != 2 ||
+                    stage->rate <= 0 || stage->B <= 0 || stage->B > INT_MAX)
+                {
+                    fprintf(stderr, "error in the input - stage is not r:B\n");
+                    exit(1);
+                }
+            } else if (strcmp(*argv, "-export") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(13);
+                }
+                strcpy(export_path, *argv);
+            } else if (strcmp(*argv, "-sample") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(18);
+                }
+                char *colon = strchr(*argv, ':');
+                sample_ms = strtod(*argv, NULL);
+                if (colon == NULL || colon[1] == '\0' || sample_ms <= 0) {
+                    fprintf(stderr, "error in the input - sample is not ms:file\n");
+                    exit(1);
+                }
+                strcpy(sample_path, colon + 1);
+            } else if (strcmp(*argv, "-trace") == 0) {
+                if (argc == 1 || *(++argv)[0] == '-') {
+                    MalformedCommandline(11);
+                }
+                strcpy(trace_path, *argv);
             } else {
                 MalformedCommandline(0); /* Unknown flag used */
             }
@@ -244,12 +585,45 @@ int IsSpaceOrTab(char *chr_ptr) {
 void PrintParams() {
     fprintf(stdout, "Emulation Parameters:\n");
     fprintf(stdout, "\tnumber to arrive = %ld\n", n);
-    if (!*buf) { fprintf(stdout, "\tlambda = %.6g\n", lambda); }
+    if (!*buf && !udp_in_port) { fprintf(stdout, "\tlambda = %.6g\n", lambda); }
     if (!*buf) { fprintf(stdout, "\tmu = %.6g\n", mu); }
     fprintf(stdout, "\tr = %.6g\n", rate);
     fprintf(stdout, "\tB = %ld\n", B);
     if (!*buf) { fprintf(stdout, "\tP = %ld\n", P); }
     if (*buf) { fprintf(stdout, "\ttsfile = %s\n", buf); }
+    if (event_loop) { fprintf(stdout, "\truntime = epoll\n"); }
+    if (edt_pacing) { fprintf(stdout, "\tpacing = earliest departure time\n"); }
+    if (coro_threads) {
+        fprintf(stdout, "\tserver coroutine threads = %ld\n", coro_threads);
+    }
+    if (speed != 1.0) { fprintf(stdout, "\tspeed = %.6g\n", speed); }
+    if (cost_counters) { fprintf(stdout, "\tcost counters = on\n"); }
+    if (rt_num_cpus) {
+        fprintf(stdout, "\trt cpus = %i", rt_cpus[0]);
+        for (int i = 1; i < rt_num_cpus; ++i) {
+            fprintf(stdout, ",%i", rt_cpus[i]);
+        }
+        fprintf(stdout, "\n");
+    }
+    if (*trace_path) { fprintf(stdout, "\ttrace = %s\n", trace_path); }
+    if (*export_path) { fprintf(stdout, "\texport = %s\n", export_path); }
+    if (*sample_path) {
+        fprintf(stdout, "\tsample = every %.6gms to %s\n", sample_ms, sample_path);
+    }
+    if (udp_in_port) {
+        fprintf(stdout, "\tudp = 127.0.0.1:%i -> 127.0.0.1:%i\n",
+                udp_in_port, udp_out_port);
+    }
+    for (int i = 0; i < num_stages; ++i) {
+        fprintf(stdout, "\tstage %i: r = %.6g, B = %ld\n",
+                stages[i].num, stages[i].rate, stages[i].B);
+    }
+    if (num_servers != 2) { fprintf(stdout, "\tservers = %ld\n", num_servers); }
+    if (batch_max > 1) { fprintf(stdout, "\tbatch = %ld\n", batch_max); }
+    if (steal_policy) {
+        fprintf(stdout, "\tsteal = %s\n",
+                steal_policy == STEAL_RR ? "rr" : "least");
+    }
     fprintf(stdout, "\n");
 }
 
@@ -264,10 +638,17 @@ void ConvertParams() {
     m = (unsigned long) mu;
     if (m > MAX_TIME) { m = MAX_TIME; }
 
-    rate = SEC_TO_MIL / rate;
-    rate = round(rate);
-    r = (unsigned long) rate;
-    if (r > MAX_TIME) { r = MAX_TIME; }
+    /* Tokens keep sub-millisecond intervals; only the cap is in milliseconds */
+    pace_interval = SEC_TO_MIC / rate / speed;
+    r = min(SEC_TO_MIC / rate, (double) MAX_TIME * MIL_TO_MIC) / speed;
+
+    for (int i = 0; i < num_stages; ++i) {
+        stages[i].r = min(SEC_TO_MIC / stages[i].rate,
+                          (double) MAX_TIME * MIL_TO_MIC) / speed;
+    }
+
+    sample_interval = (unsigned long) (sample_ms * MIL_TO_MIC / speed + 0.5);
+    if (sample_interval == 0) { sample_interval = 1; }
 }
 
 unsigned long GetTime(struct timeval *tv) {
@@ -276,6 +657,76 @@ unsigned long GetTime(struct timeval *tv) {
     return current_time;
 }
 
+double ScaleTimeExact(unsigned long milliseconds) {
+    /* Delay in unrounded microseconds after applying the -speed factor */
+    return milliseconds * MIL_TO_MIC / speed;
+}
+
+unsigned long ScaleTime(unsigned long milliseconds) {
+    /* Delay in microseconds after applying the -speed factor */
+    return (unsigned long) (ScaleTimeExact(milliseconds) + 0.5);
+}
+
+void SleepUntil(unsigned long deadline) {
+    if (CoroSelf() != NULL) { /* never block a coroutine's scheduler thread */
+        CoroSleepUntil(deadline);
+        return;
+    }
+    /*
+     * Simulate passage of time with usleep().  When time is compressed,
+     * usleep() overshoot is a large fraction of each delay, so wake early
+     * and spin (yielding) through the last SPIN_THRESHOLD microseconds.
+     */
+    struct timeval tv;
+    unsigned long now = GetTime(&tv);
+    unsigned long spin = (speed > 1.0) ? SPIN_THRESHOLD : 0UL;
+    if (deadline > now + spin) {
+        usleep(deadline - now - spin);
+    }
+    if (spin > 0) {
+        while (GetTime(&tv) < deadline) { sched_yield(); }
+    }
+}
+
+void RecordDrift(Drift *drift, unsigned long actual, unsigned long intended) {
+    long diff = (long) (actual - intended);
+    ++drift->count;
+    drift->total += diff;
+    drift->total_sqr += (double) diff * diff;
+    if (diff > drift->worst) { drift->worst = diff; }
+}
+
+unsigned long CostBegin() {
+    /* Monotonic nanoseconds, or 0 without -cost */
+    if (!cost_counters) { return 0UL; }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void RecordCost(Cost *cost, unsigned long begin) {
+    /* Caller holds mut */
+    if (!cost_counters) { return; }
+    unsigned long elapsed = CostBegin() - begin;
+    ++cost->count;
+    cost->total += elapsed;
+    if (elapsed > cost->worst) { cost->worst = elapsed; }
+}
+
+void LockMut() {
+    /* pthread_mutex_lock(&mut), timing the wait when it is contended */
+    QDISC_PROBE0(mut__lock);
+    if (!cost_counters) {
+        pthread_mutex_lock(&mut);
+    } else if (pthread_mutex_trylock(&mut) != 0) {
+        unsigned long begin = CostBegin();
+        pthread_mutex_lock(&mut);
+        RecordCost(&mut_wait, begin);
+    }
+    ++mut_acquisitions;
+    QDISC_PROBE0(mut__acquired);
+}
+
 void PrintTime(unsigned long time) {
     time -= emulation_begin;
     int milliseconds = (int) (time / MIC_TO_MIL);
@@ -284,108 +735,445 @@ void PrintTime(unsigned long time) {
     fprintf(stdout, ".%03dms: ", milliseconds_decimal);
 }
 
+int Q2Length() {
+    /* Under -steal, Q2 is the union of the servers' local queues */
+    if (edt_pacing) { return PacketHeapLength(&Q2_heap); }
+    return steal_policy ? q2_packets : PrioQueueLength(&Q2);
+}
+
+void LogStageEvent(Stage *stage, int type, unsigned long time, int num,
+                   int server, int value, int aux) {
+    /* Caller holds mut (or is the only running thread) */
+    if (!EventLogEnabled()) { return; }
+
+    EventRecord rec;
+    rec.time = time - emulation_begin;
+    rec.type = type;
+    rec.stage = (stage != NULL) ? stage->num : 0;
+    rec.num = num;
+    rec.server = server;
+    rec.q1_len = PrioQueueLength(&Q1);
+    rec.q2_len = Q2Length();
+    rec.bucket = (stage != NULL) ? stage->bucket : token_bucket;
+    rec.value = value;
+    rec.aux = aux;
+    EventLogWrite(&rec);
+}
+
+void LogEvent(int type, unsigned long time, int num, int server,
+              int value, int aux) {
+    LogStageEvent(NULL, type, time, num, server, value, aux);
+}
+
 void PrintEmulationBegins() {
     struct timeval tv;
     emulation_begin = GetTime(&tv);
+    LogEvent(EV_EMULATION_BEGINS, emulation_begin, 0, 0, 0, 0);
 
     PrintTime(current_time);
     fprintf(stdout, "emulation begins\n");
 }
 
-void ReadLine(int *arr_t, int *tok, int *ser_t, int line_num) {
-    if (sscanf(buf, "%d %d %d", arr_t, tok, ser_t) != 3) {
+void ReadLine(int *arr_t, int *tok, int *ser_t, int *band, int line_num) {
+    /* Optional 4th column: priority band, 0 (first served) to 63 */
+    *band = 0;
+    int fields = sscanf(buf, "%d %d %d %d", arr_t, tok, ser_t, band);
+    if (fields < 3 || *band < 0 || *band >= PRIO_BANDS) {
         NotValidFile(line_num);
     }
 }
 
+void FreePacket(int p) {
+    if (pkts.slot[p] >= 0) {
+        UdpReleaseSlot(pkts.slot[p]);
+        pkts.slot[p] = -1;
+    }
+}
+
+void ForwardPackets(int *departed, int count) {
+    /* Send departed UDP payloads straight from their slots, then free */
+    if (udp_in_port) {
+        int slots[UDP_BATCH];
+        int lens[UDP_BATCH];
+        int pending = 0;
+        for (int i = 0; i < count; ++i) {
+            if (pkts.slot[departed[i]] < 0) { continue; }
+            slots[pending] = pkts.slot[departed[i]];
+            lens[pending] = pkts.length[departed[i]];
+            if (++pending == UDP_BATCH) {
+                UdpSendBatch(udp_fd, udp_out_port, slots, lens, pending);
+                pending = 0;
+            }
+        }
+        if (pending > 0) {
+            UdpSendBatch(udp_fd, udp_out_port, slots, lens, pending);
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        FreePacket(departed[i]);
+    }
+}
+
+void RemovePacket(int p, int queue) {
+    /* queue is 1 (Q1) or 2 (Q2) */
+    struct timeval tv;
+    PrintTime(GetTime(&tv));
+    LogEvent(EV_PACKET_REMOVED, current_time, p, 0, 0, queue);
+    fprintf(stdout, "p%i removed from Q%i\n", p, queue);
+    pkts.fate[p] = FATE_REMOVED;
+    FreePacket(p);
+    ++removed_packets;
+}
+
 void SigQuit() {
-    while (!MyListEmpty(&Q1)) {
-        MyListElem *elem = MyListFirst(&Q1);
-        Packet *p = elem->obj;
-        MyListUnlink(&Q1, elem);
-        struct timeval tv;
-        PrintTime(GetTime(&tv));
-        fprintf(stdout, "p%i removed from Q1\n", p->num);
-        free(p);
-        ++removed_packets;
+    while (!PrioQueueEmpty(&Q1)) {
+        RemovePacket(PrioQueuePop(&Q1), 1);
     }
-    while (!MyListEmpty(&Q2)) {
-        MyListElem *elem = MyListFirst(&Q2);
-        Packet *p = elem->obj;
-        MyListUnlink(&Q2, elem);
-        struct timeval tv;
-        PrintTime(GetTime(&tv));
-        fprintf(stdout, "p%i removed from Q2\n", p->num);
-        free(p);
-        ++removed_packets;
+    while (!PrioQueueEmpty(&Q2)) {
+        RemovePacket(PrioQueuePop(&Q2), 2);
+    }
+    while (edt_pacing && PacketHeapLength(&Q2_heap) > 0) {
+        RemovePacket(PacketHeapPop(&Q2_heap), 2);
+    }
+    for (int i = 0; i < num_servers && steal_policy; ++i) {
+        PacketFifo *local_q = &servers[i].local_q;
+        while (local_q->length > 0) {
+            int p = PacketFifoPop(local_q, pkts.next);
+            --q2_packets;
+            RemovePacket(p, 2);
+        }
     }
 }
 
-void PacketArrives(Packet *packet, unsigned long *last_arr_time) {
+void PacketArrives(int p, unsigned long *last_arr_time) {
+    unsigned long cost_begin = CostBegin();
     struct timeval tv;
-    packet->arrival_time = GetTime(&tv);
+    pkts.arrival[p] = GetTime(&tv);
 
     int diff = (int) (current_time - *last_arr_time);
     int milliseconds = diff / MIC_TO_MIL;
     int milliseconds_decimal = diff % MIC_TO_MIL;
 
-    packet->inter_arrival_time = diff; /* Measured inter-arrival time */
+    pkts.inter_arrival_time[p] = diff; /* Measured inter-arrival time */
     *last_arr_time = current_time;
+    LogEvent(EV_PACKET_ARRIVES, pkts.arrival[p], p, 0,
+             diff, pkts.tokens_required[p]);
+    QDISC_PROBE3(packet__arrive, p, pkts.tokens_required[p], diff);
 
     PrintTime(current_time);
     fprintf(stdout, 
             "p%i arrives, needs %i tokens, inter-arrival time = ",
-            packet->num, packet->tokens_required);
+            p, pkts.tokens_required[p]);
     fprintf(stdout, "%d", milliseconds);
     fprintf(stdout, ".%03dms", milliseconds_decimal);
+    RecordCost(&event_costs[COST_PACKET_ARRIVES], cost_begin);
 }
 
-void PacketEntersQ1(Packet *p) {
+void PacketEntersQ1(int p) {
+    unsigned long cost_begin = CostBegin();
     struct timeval tv;
-    p->enter_time = GetTime(&tv);
+    pkts.q1_enter[p] = GetTime(&tv);
+    LogEvent(EV_Q1_ENTER, pkts.q1_enter[p], p, 0, 0, pkts.band[p]);
+    QDISC_PROBE2(q1__enter, p, pkts.band[p]);
     PrintTime(current_time);
-    fprintf(stdout, "p%i enters Q1\n", p->num);
+    fprintf(stdout, "p%i enters Q1\n", p);
+    RecordCost(&event_costs[COST_Q1_ENTER], cost_begin);
 }
 
-void PacketLeavesQ1(Packet *p) {
+void PacketLeavesQ1(int p) {
+    unsigned long cost_begin = CostBegin();
     struct timeval tv;
-    p->leave_time = GetTime(&tv);
+    pkts.q1_leave[p] = GetTime(&tv);
     
-    int diff = (int) (current_time - p->enter_time); /* Time in Q1 */
+    int diff = (int) (current_time - pkts.q1_enter[p]); /* Time in Q1 */
     int milliseconds = diff / MIC_TO_MIL;
     int milliseconds_decimal = diff % MIC_TO_MIL;
 
-    total_Q1_time += diff; /* For running averages */
+    LogEvent(EV_Q1_LEAVE, pkts.q1_leave[p], p, 0, diff, 0);
+    QDISC_PROBE2(q1__leave, p, diff);
 
     PrintTime(current_time);
-    fprintf(stdout, "p%i leaves Q1, time in Q1 = ", p->num);
+    fprintf(stdout, "p%i leaves Q1, time in Q1 = ", p);
     fprintf(stdout, "%d", milliseconds);
     fprintf(stdout, ".%03dms", milliseconds_decimal);
     fprintf(stdout, ", token bucket now has %i token", token_bucket);
     if (token_bucket > 1) { fprintf(stdout, "s"); }
     fprintf(stdout, "\n");
+    RecordCost(&event_costs[COST_Q1_LEAVE], cost_begin);
+}
+
+void PacketEntersQ2(int p) {
+    unsigned long cost_begin = CostBegin();
+    struct timeval tv;
+    pkts.q2_enter[p] = GetTime(&tv);
+    QDISC_PROBE2(q2__enter, p, pkts.band[p]);
+    if (!edt_pacing) {
+        LogEvent(EV_Q2_ENTER, pkts.q2_enter[p], p, 0, 0, pkts.band[p]);
+        PrintTime(current_time);
+        fprintf(stdout, "p%i enters Q2\n", p);
+    } else {
+        /* value = how long the packet is held back before it may depart */
+        long hold = (long) (pkts.departure_due[p] - current_time);
+        if (hold < 0) { hold = 0; }
+        LogEvent(EV_Q2_ENTER, pkts.q2_enter[p], p, 0, (int) hold, pkts.band[p]);
+        PrintTime(current_time);
+        fprintf(stdout, "p%i enters Q2, departs in %ld.%03ldms\n", p,
+                hold / MIC_TO_MIL, hold % MIC_TO_MIL);
+    }
+    RecordCost(&event_costs[COST_Q2_ENTER], cost_begin);
+}
+
+int BatchBucket(int batch_size) {
+    int bucket = 0;
+    while (batch_size > 1 && bucket < BATCH_HIST_BUCKETS - 1) {
+        batch_size >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+void IdlePush(ServerSlot *slot) {
+    slot->idle = TRUE;
+    slot->idle_pos = idle_top;
+    idle_stack[idle_top++] = slot->num - 1;
+}
+
+void IdleRemove(ServerSlot *slot) {
+    /* Constant time from anywhere in the stack; the top entry fills the hole */
+    int top = idle_stack[--idle_top];
+    idle_stack[slot->idle_pos] = top;
+    servers[top].idle_pos = slot->idle_pos;
+    slot->idle = FALSE;
+}
+
+void ServerWait(ServerSlot *slot) {
+    /* Park on the idle stack until a producer pops and signals this slot */
+    if (!slot->idle) { IdlePush(slot); }
+    if (slot->coro != NULL) {
+        CoroPark(&mut);
+    } else {
+        pthread_cond_wait(&slot->cv, &mut);
+    }
+}
+
+void ServerUnpark(ServerSlot *slot) {
+    /* Woke without being popped (e.g. spurious); take ourselves off */
+    if (slot->idle) { IdleRemove(slot); }
+}
+
+void EventLoopStartServer(ServerSlot *slot);
+
+void WakeServer(ServerSlot *slot) {
+    /* slot has already been taken off the idle stack */
+    if (event_loop) { /* no thread to wake; hand it work directly */
+        EventLoopStartServer(slot);
+        return;
+    }
+    ++wakeups_issued;
+    if (slot->coro != NULL) {
+        CoroWake(slot->coro);
+    } else {
+        pthread_cond_signal(&slot->cv);
+    }
+}
+
+void WakeServers(int count) {
+    while (count-- > 0 && idle_top > 0) {
+        ServerSlot *slot = &servers[idle_stack[idle_top - 1]];
+        IdleRemove(slot);
+        WakeServer(slot);
+    }
+}
+
+void WakeAllServers() {
+    WakeServers(idle_top);
+}
+
+ServerSlot *Q2Push(int p) {
+    /*
+     * Appends p to the shared Q2 or, under -steal, to one server's local
+     * queue.  Returns that server if it was idle (now off the idle stack,
+     * for the caller to wake), otherwise NULL.
+     */
+    if (edt_pacing) {
+        PacketHeapPush(&Q2_heap, p);
+        return NULL;
+    }
+    if (!steal_policy) {
+        PrioQueueAppend(&Q2, p, pkts.band[p]);
+        return NULL;
+    }
+    ServerSlot *owner;
+    if (steal_policy == STEAL_RR) {
+        owner = &servers[next_server];
+        next_server = (next_server + 1) % num_servers;
+    } else if (idle_top > 0) { /* an idle server has the shortest queue */
+        owner = &servers[idle_stack[idle_top - 1]];
+    } else {
+        owner = &servers[0];
+        for (int i = 1; i < num_servers; ++i) {
+            if (servers[i].local_q.length < owner->local_q.length)
+            {
+                owner = &servers[i];
+            }
+        }
+    }
+    PacketFifoAppend(&owner->local_q, pkts.next, p);
+    ++q2_packets;
+    if (!owner->idle) { return NULL; }
+    IdleRemove(owner);
+    return owner;
+}
+
+int MoveToQ2(int p) {
+    /* Returns 1 if the packet's owner had to be woken (-steal only) */
+    ServerSlot *owner = Q2Push(p);
+    PacketEntersQ2(p);
+    if (owner == NULL) { return 0; }
+    WakeServer(owner);
+    return 1;
 }
 
-void PacketEntersQ2(Packet *p) {
+void PacketEntersStage(Stage *stage, int p) {
+    /* Caller holds mut and has checked that the stage has room */
     struct timeval tv;
-    p->enter_time = GetTime(&tv);
+    GetTime(&tv);
     PrintTime(current_time);
-    fprintf(stdout, "p%i enters Q2\n", p->num);
+    if (pkts.tokens_required[p] > stage->B) {
+        ++dropped_packets;
+        LogStageEvent(stage, EV_PACKET_DROPPED, current_time, p, 0, 0, 0);
+        fprintf(stdout, "p%i dropped at stage %i\n", p, stage->num);
+        pkts.fate[p] = FATE_DROPPED;
+        FreePacket(p);
+        return;
+    }
+    StageQueuePush(&stage->queue, p, current_time);
+    ++in_pipeline;
+    LogStageEvent(stage, EV_STAGE_ENTER, current_time, p, 0, 0, 0);
+    fprintf(stdout, "p%i enters stage %i\n", p, stage->num);
 }
 
 void CheckQ1() {
-    Packet *packet = MyListFirst(&Q1)->obj;
-    if (token_bucket >= packet->tokens_required) {
-        token_bucket -= packet->tokens_required;
-        MyListUnlink(&Q1, MyListFirst(&Q1));
-        PacketLeavesQ1(packet);
-        MyListAppend(&Q2, packet);
-        PacketEntersQ2(packet);
-        pthread_cond_broadcast(&cv);
+    /* Move every packet the bucket can currently pay for, then wake once */
+    int moved = 0, woken = 0;
+    while (!PrioQueueEmpty(&Q1)) {
+        int p = PrioQueueFirst(&Q1); /* highest band first */
+        if (token_bucket < pkts.tokens_required[p]) { break; }
+        if (num_stages > 0 && StageQueueFull(&stages[0].queue)) {
+            break; /* held in Q1, retried when the next token arrives */
+        }
+        token_bucket -= pkts.tokens_required[p];
+        PrioQueuePop(&Q1);
+        PacketLeavesQ1(p);
+        if (num_stages > 0) {
+            PacketEntersStage(&stages[0], p);
+        } else {
+            woken += MoveToQ2(p);
+        }
+        ++moved;
+    }
+    if (moved > 0) {
+        ++transfer_batches[BatchBucket(moved)];
+        if (num_stages == 0) {
+            WakeServers(moved - woken); /* under -steal, these become thieves */
+        }
+    }
+}
+
+void PacketLeavesStage(Stage *stage, StageEntry *entry) {
+    int p = entry->num;
+    struct timeval tv;
+    GetTime(&tv);
+    --in_pipeline;
+
+    int diff = (int) (current_time - entry->enter); /* Time in the stage */
+    int milliseconds = diff / MIC_TO_MIL;
+    int milliseconds_decimal = diff % MIC_TO_MIL;
+
+    StatsSummary *latency = &stage->latency;
+    if (latency->count == 0 || diff < latency->min) { latency->min = diff; }
+    if (latency->count == 0 || diff > latency->max) { latency->max = diff; }
+    ++latency->count;
+    latency->sum += diff;
+    latency->sum_sqr += (double) diff * diff;
+    LogStageEvent(stage, EV_STAGE_LEAVE, current_time, p, 0, diff, 0);
+
+    PrintTime(current_time);
+    fprintf(stdout, "p%i leaves stage %i, time in stage %i = ",
+            p, stage->num, stage->num);
+    fprintf(stdout, "%d", milliseconds);
+    fprintf(stdout, ".%03dms", milliseconds_decimal);
+    fprintf(stdout, ", stage %i bucket now has %i token", stage->num,
+            stage->bucket);
+    if (stage->bucket > 1) { fprintf(stdout, "s"); }
+    fprintf(stdout, "\n");
+}
+
+void StageForward(Stage *stage) {
+    /* Caller holds mut; the stage's own CheckQ1() */
+    Stage *next = (stage->num - 1 < num_stages) ? stage + 1 : NULL;
+    int moved = 0, woken = 0;
+    StageEntry *entry;
+    while ((entry = StageQueuePeek(&stage->queue)) != NULL) {
+        int p = entry->num;
+        if (stage->bucket < pkts.tokens_required[p]) { break; }
+        if (next != NULL && StageQueueFull(&next->queue)) { break; }
+        stage->bucket -= pkts.tokens_required[p];
+        PacketLeavesStage(stage, entry);
+        StageQueuePop(&stage->queue);
+        if (next != NULL) {
+            PacketEntersStage(next, p);
+        } else {
+            woken += MoveToQ2(p);
+            ++moved;
+        }
+    }
+    if (moved > 0) {
+        WakeServers(moved - woken);
+    }
+}
+
+void StageTokenArrives(Stage *stage, int t_num) {
+    struct timeval tv;
+    GetTime(&tv);
+
+    PrintTime(current_time);
+    fprintf(stdout, "token t%i arrives at stage %i, ", t_num, stage->num);
+    if (stage->bucket < stage->B) {
+        ++stage->bucket;
+        ++stage->accepted_tokens;
+        LogStageEvent(stage, EV_TOKEN_ARRIVES, current_time, t_num, 0, 0, 0);
+        if (stage->bucket == 1) {
+            fprintf(stdout, "stage %i bucket now has 1 token\n", stage->num);
+        } else {
+            fprintf(stdout, "stage %i bucket now has %i tokens\n",
+                    stage->num, stage->bucket);
+        }
+    } else {
+        ++stage->dropped_tokens;
+        LogStageEvent(stage, EV_TOKEN_DROPPED, current_time, t_num, 0, 0, 0);
+        fprintf(stdout, "dropped\n");
+    }
+}
+
+void StageRemovePackets(Stage *stage) {
+    StageEntry *entry;
+    while ((entry = StageQueuePeek(&stage->queue)) != NULL) {
+        int p = entry->num;
+        StageQueuePop(&stage->queue);
+        --in_pipeline;
+        struct timeval tv;
+        PrintTime(GetTime(&tv));
+        LogStageEvent(stage, EV_PACKET_REMOVED, current_time, p, 0, 0, 3);
+        fprintf(stdout, "p%i removed from stage %i\n", p, stage->num);
+        pkts.fate[p] = FATE_REMOVED;
+        FreePacket(p);
+        ++removed_packets;
     }
 }
 
 void TokenArrives(int t_num, unsigned long *last_tok_time) {
+    unsigned long cost_begin = CostBegin();
     struct timeval tv;
     *last_tok_time = GetTime(&tv);
 
@@ -394,6 +1182,8 @@ void TokenArrives(int t_num, unsigned long *last_tok_time) {
     if (token_bucket < B) {
         ++token_bucket;
         ++accepted_tokens;
+        LogEvent(EV_TOKEN_ARRIVES, *last_tok_time, t_num, 0, 0, 0);
+        QDISC_PROBE2(token__arrive, t_num, token_bucket);
         if (token_bucket == 1) {
             fprintf(stdout, "token bucket now has 1 token\n");
         } else {
@@ -401,173 +1191,620 @@ void TokenArrives(int t_num, unsigned long *last_tok_time) {
         }
     } else {
         ++dropped_tokens;
+        LogEvent(EV_TOKEN_DROPPED, *last_tok_time, t_num, 0, 0, 0);
+        QDISC_PROBE1(token__drop, t_num);
         fprintf(stdout, "dropped\n");
     }
+    RecordCost(&event_costs[COST_TOKEN_ARRIVES], cost_begin);
 }
 
-void PacketLeavesQ2(Packet *p) {
+void PacketLeavesQ2(int p) {
+    unsigned long cost_begin = CostBegin();
     struct timeval tv;
-    p->leave_time = GetTime(&tv);
+    pkts.q2_leave[p] = GetTime(&tv);
     
-    int diff = (int) (current_time - p->enter_time); /* Time in Q2 */
+    int diff = (int) (current_time - pkts.q2_enter[p]); /* Time in Q2 */
     int milliseconds = diff / MIC_TO_MIL;
     int milliseconds_decimal = diff % MIC_TO_MIL;
 
-    total_Q2_time += diff; /* For running averages */
+    LogEvent(EV_Q2_LEAVE, pkts.q2_leave[p], p, 0, diff, 0);
+    QDISC_PROBE2(q2__leave, p, diff);
 
     PrintTime(current_time);
-    fprintf(stdout, "p%i leaves Q2, time in Q2 = ", p->num);
+    fprintf(stdout, "p%i leaves Q2, time in Q2 = ", p);
     fprintf(stdout, "%d", milliseconds);
     fprintf(stdout, ".%03dms\n", milliseconds_decimal);
+    RecordCost(&event_costs[COST_Q2_LEAVE], cost_begin);
+}
+
+int StealQ2(ServerSlot *slot, int *batch) {
+    /*
+     * Own queue is empty: take the older half of the longest peer queue
+     * from its head, at most batch_max (one packet with the default
+     * -batch 1).  These have waited longest behind the busy owner, so
+     * stealing them keeps service close to arrival order.
+     */
+    ServerSlot *victim = NULL;
+    for (int i = 0; i < num_servers; ++i) {
+        if (victim == NULL ||
+            servers[i].local_q.length > victim->local_q.length)
+        {
+            victim = &servers[i];
+        }
+    }
+    int claim = (victim->local_q.length + 1) / 2;
+    if (claim > batch_max) { claim = batch_max; }
+
+    for (int i = 0; i < claim; ++i) {
+        batch[i] = PacketFifoPop(&victim->local_q, pkts.next);
+        --q2_packets;
+    }
+    slot->steals += claim;
+    return claim;
 }
 
-Packet *CheckQ2() {
-    Packet *packet = MyListFirst(&Q2)->obj;
-    MyListUnlink(&Q2, MyListFirst(&Q2));
-    PacketLeavesQ2(packet);
-    return packet;
+int CheckQ2(ServerSlot *slot, int *batch) {
+    /* Claim up to batch_max packets, leaving the other servers a fair share */
+    int claim = (Q2Length() + num_servers - 1) / num_servers;
+    if (steal_policy) { /* the local queue is all ours */
+        if (slot->local_q.length == 0) {
+            claim = StealQ2(slot, batch);
+            ++claim_batches[BatchBucket(claim)];
+            return claim;
+        }
+        claim = slot->local_q.length;
+    }
+    if (claim > batch_max) { claim = batch_max; }
+
+    /* Each packet is logged as leaving Q2 when its own service begins */
+    for (int i = 0; i < claim; ++i) {
+        if (edt_pacing) {
+            batch[i] = PacketHeapPop(&Q2_heap);
+        } else if (steal_policy) {
+            batch[i] = PacketFifoPop(&slot->local_q, pkts.next);
+            --q2_packets;
+        } else {
+            batch[i] = PrioQueuePop(&Q2); /* highest band first */
+        }
+    }
+    ++claim_batches[BatchBucket(claim)];
+    return claim;
 }
 
-void BeginService(Packet *packet, int s_num) {
+void BeginService(int p, int s_num) {
+    unsigned long cost_begin = CostBegin();
     struct timeval tv;
-    packet->enter_time = GetTime(&tv);
+    pkts.service_begin[p] = GetTime(&tv);
+    pkts.server[p] = s_num;
+    ++busy_servers;
+    LogEvent(EV_SERVICE_BEGIN, pkts.service_begin[p], p, s_num,
+             0, pkts.service_time_requested[p]);
+    QDISC_PROBE3(service__begin, p, s_num, pkts.service_time_requested[p]);
 
     PrintTime(current_time);
     fprintf(stdout,
             "p%i begins service at S%i, requesting %ims of service\n",
-            packet->num, s_num, packet->service_time_requested);
+            p, s_num, pkts.service_time_requested[p]);
+    RecordCost(&event_costs[COST_SERVICE_BEGIN], cost_begin);
+}
+
+void RecordDeparture(unsigned long time) {
+    /* Departures leave in lock order, so the gap is to the previous one */
+    if (last_departure != 0UL) {
+        double gap = (double) (time - last_departure);
+        if (departure_stats.count == 0) {
+            departure_stats.min = departure_stats.max = gap;
+        }
+        ++departure_stats.count;
+        departure_stats.sum += gap;
+        departure_stats.sum_sqr += gap * gap;
+        departure_stats.min = min(departure_stats.min, gap);
+        departure_stats.max = max(departure_stats.max, gap);
+    }
+    last_departure = time;
 }
 
-void DepartService(Packet *p, int s_num) {
+void DepartService(int p, ServerSlot *slot) {
+    unsigned long cost_begin = CostBegin();
+    int s_num = slot->num;
     struct timeval tv;
-    p->leave_time = GetTime(&tv);
+    pkts.service_end[p] = GetTime(&tv);
+    pkts.fate[p] = FATE_SERVED;
     
     /* Measured service time (microseconds) */
-    int diff = (int) (current_time - p->enter_time); 
+    int diff = (int) (current_time - pkts.service_begin[p]); 
     int milliseconds = diff / MIC_TO_MIL;
     int milliseconds_decimal = diff % MIC_TO_MIL;
 
-    /* Service time running averages */
-    if (s_num == 1) { total_S1_time += diff; }
-    else { total_S2_time += diff; }
-    avg_service_time = (avg_service_time * (completed_packets) +
-                        diff) / (completed_packets + 1);
-
-    unsigned long time_in_system = current_time - p->arrival_time;
+    slot->total_time += diff; /* For server occupancy */
+    --busy_servers;
+    RecordDeparture(current_time);
+    LogEvent(EV_SERVICE_END, pkts.service_end[p], p, s_num, diff, 0);
+    QDISC_PROBE3(service__end, p, s_num, diff);
+    unsigned long time_in_system = current_time - pkts.arrival[p];
     int ms = time_in_system / MIC_TO_MIL;
     int ms_decimal = time_in_system % MIC_TO_MIL;
 
-    /* Time in system running averages */
-    avg_x = (avg_x * (completed_packets) +
-             ((double) time_in_system / MIC_TO_MIL))
-             / (completed_packets + 1);
-    avg_x_sqr = (avg_x_sqr * (completed_packets) +
-                 pow(time_in_system / (double) MIC_TO_MIL, 2))
-                 / (completed_packets + 1);
     ++completed_packets;
 
     PrintTime(current_time);
-    fprintf(stdout, "p%i departs from S%i, service time = ", p->num, s_num);
+    fprintf(stdout, "p%i departs from S%i, service time = ", p, s_num);
     fprintf(stdout, "%d", milliseconds);
     fprintf(stdout, ".%03dms", milliseconds_decimal);
     fprintf(stdout, ", time in system = ");
     fprintf(stdout, "%d", ms);
     fprintf(stdout, ".%03dms\n", ms_decimal);
+    RecordCost(&event_costs[COST_SERVICE_END], cost_begin);
 }
 
 void PrintEmulationEnds() {
     struct timeval tv;
     emulation_end = GetTime(&tv);
+    LogEvent(EV_EMULATION_ENDS, emulation_end, 0, 0, 0, 0);
 
     PrintTime(current_time);
     fprintf(stdout, "emulation ends\n");
     fprintf(stdout, "\n");
 }
 
-void PrintStatistics() {
-    fprintf(stdout, "Statistics:\n");
+void PrintBatchHistogram(char *name, int *hist) {
+    fprintf(stdout, "\t%s:", name);
+    int total = 0;
+    for (int i = 0; i < BATCH_HIST_BUCKETS; ++i) {
+        if (hist[i] == 0) { continue; }
+        total += hist[i];
+        if (i == 0) {
+            fprintf(stdout, " [1] = %i", hist[i]);
+        } else if (i == BATCH_HIST_BUCKETS - 1) {
+            fprintf(stdout, " [%i+] = %i", 1 << i, hist[i]);
+        } else {
+            fprintf(stdout, " [%i-%i] = %i", 1 << i, (1 << (i + 1)) - 1, hist[i]);
+        }
+    }
+    if (total == 0) { fprintf(stdout, " \"N/A\" no batches"); }
     fprintf(stdout, "\n");
+}
 
-    if (avg_inter_arrival_time == 0) {
-        fprintf(stdout,
-                "\taverage packet inter-arrival time = \"N/A\" no packet arrived\n");
-    } else {
-        fprintf(stdout, "\taverage packet inter-arrival time = %.6g\n", 
-                (double) avg_inter_arrival_time / MIC_TO_SEC);
+void PrintDrift(char *name, Drift *drift) {
+    if (drift->count == 0) {
+        fprintf(stdout, "\t%s drift = \"N/A\" no events\n", name);
+        return;
     }
-    if (completed_packets == 0) {
-        fprintf(stdout,
-                "\taverage packet service time = \"N/A\" no packet served\n");
-    } else {
-        fprintf(stdout, "\taverage packet service time = %.6g\n", 
-                (double) avg_service_time / MIC_TO_SEC);
+    /* Real microseconds; multiplied by speed they are trace-time error */
+    double avg = drift->total / drift->count;
+    double variance = drift->total_sqr / drift->count - avg * avg;
+    double jitter = (variance > 0) ? sqrt(variance) : 0.0;
+    fprintf(stdout, "\t%s drift = average %.6gms, worst %.6gms, jitter %.6gms",
+            name, avg / MIC_TO_MIL, (double) drift->worst / MIC_TO_MIL,
+            jitter / MIC_TO_MIL);
+    if (speed != 1.0) {
+        fprintf(stdout, " (trace time: average %.6gms, worst %.6gms)",
+                avg * speed / MIC_TO_MIL,
+                (double) drift->worst * speed / MIC_TO_MIL);
     }
     fprintf(stdout, "\n");
+}
 
-    fprintf(stdout, "\taverage number of packets in Q1 = %.6g\n", 
-            (double) total_Q1_time 
-            / (emulation_end - emulation_begin));
-    fprintf(stdout, "\taverage number of packets in Q2 = %.6g\n", 
-            (double) total_Q2_time 
-            / (emulation_end - emulation_begin));
-    fprintf(stdout, "\taverage number of packets in S1 = %.6g\n", 
-            (double) total_S1_time 
-            / (emulation_end - emulation_begin));
-    fprintf(stdout, "\taverage number of packets in S2 = %.6g\n", 
-            (double) total_S2_time 
-            / (emulation_end - emulation_begin));
-    fprintf(stdout, "\n");
-
-    if (completed_packets == 0) {
-        fprintf(stdout,
-                "\taverage time a packet spent in system = \"N/A\" no packet served\n");
-        fprintf(stdout,
-                "\tstandard deviation for time spent in system = \"N/A\" no packet served\n");
-    } else {
-        fprintf(stdout, "\taverage time a packet spent in system = %.6g\n", 
-                avg_x / MIL_TO_SEC);
-        fprintf(stdout, "\tstandard deviation for time spent in system = %.6g\n", 
-                sqrt((avg_x_sqr) - pow(avg_x, 2)) / MIL_TO_SEC);
+void ReduceStatistics() {
+    /* Gather each per-stage duration into one array and reduce it */
+    double *values = (double *) malloc(((size_t) pkts.capacity + 1) *
+                                       sizeof(double));
+    struct timeval begin, end;
+    gettimeofday(&begin, NULL);
+
+    long count = PacketStoreDurations(&pkts, pkts.arrival,
+                                      pkts.inter_arrival_time, NULL, values);
+    StatsReduce(values, count, &inter_arrival_stats);
+    count = PacketStoreDurations(&pkts, pkts.q1_leave, pkts.q1_leave,
+                                 pkts.q1_enter, values);
+    StatsReduce(values, count, &Q1_stats);
+    count = PacketStoreDurations(&pkts, pkts.q2_leave, pkts.q2_leave,
+                                 pkts.q2_enter, values);
+    StatsReduce(values, count, &Q2_stats);
+    count = PacketStoreDurations(&pkts, pkts.service_end, pkts.service_end,
+                                 pkts.service_begin, values);
+    StatsReduce(values, count, &service_stats);
+    count = PacketStoreDurations(&pkts, pkts.service_end, pkts.service_end,
+                                 pkts.arrival, values);
+    StatsReduce(values, count, &system_stats);
+
+    memset(system_hist, 0, sizeof(system_hist));
+    if (count > 0) {
+        StatsHistogram(values, count, system_stats.min,
+                       (system_stats.max - system_stats.min) / SYSTEM_HIST_BUCKETS,
+                       system_hist, SYSTEM_HIST_BUCKETS);
     }
-    fprintf(stdout, "\n");
 
-    if (dropped_tokens + accepted_tokens == 0) {
-        fprintf(stdout, "\tpacket drop probability = \"N/A\" no token arrived\n");
-    } else {
-        fprintf(stdout, "\ttoken drop probability = %.6g\n", 
-                (double) dropped_tokens / (dropped_tokens + accepted_tokens));
+    gettimeofday(&end, NULL);
+    reduction_time = ((end.tv_sec - begin.tv_sec) * SEC_TO_MIC +
+                      (end.tv_usec - begin.tv_usec)) / (double) MIC_TO_MIL;
+    free(values);
+}
+
+void PrintServerOccupancy() {
+    double elapsed = (double) (emulation_end - emulation_begin);
+    if (num_servers <= MAX_LISTED_SERVERS) {
+        for (int i = 0; i < num_servers; ++i) {
+            fprintf(stdout, "\taverage number of packets in S%i = %.6g\n", 
+                    servers[i].num, servers[i].total_time / elapsed);
+        }
+        return;
     }
-    if (dropped_packets + completed_packets + removed_packets == 0) {
-        fprintf(stdout, "\tpacket drop probability = \"N/A\" no packet arrived\n");
-    } else {
-        fprintf(stdout, "\tpacket drop probability = %.6g\n", 
-                (double) dropped_packets
-                / (dropped_packets + completed_packets + removed_packets));
+    double lo = servers[0].total_time, hi = lo, total = 0.0;
+    for (int i = 0; i < num_servers; ++i) {
+        lo = min(lo, (double) servers[i].total_time);
+        hi = max(hi, (double) servers[i].total_time);
+        total += servers[i].total_time;
     }
+    fprintf(stdout, "\taverage number of packets in S1..S%ld = %.6g total, "
+            "%.6g per server (min %.6g, max %.6g)\n", num_servers,
+            total / elapsed, total / num_servers / elapsed,
+            lo / elapsed, hi / elapsed);
 }
 
-/* ----------------------- First Procedures ----------------------- */
-
-void *monitor(void *arg) {
-    int sig = 0;
+void PrintServerQueueing() {
+    /* Time in Q2 grouped by the server that took the packet */
+    double *sum = (double *) calloc(num_servers, sizeof(double));
+    long *count = (long *) calloc(num_servers, sizeof(long));
+    for (int p = 1; p <= pkts.capacity; ++p) {
+        if (pkts.fate[p] != FATE_SERVED) { continue; }
+        sum[pkts.server[p] - 1] += pkts.q2_leave[p] - pkts.q2_enter[p];
+        ++count[pkts.server[p] - 1];
+    }
+
+    double lo = -1.0, hi = -1.0;
+    unsigned long steals = 0UL, most_steals = 0UL;
+    for (int i = 0; i < num_servers; ++i) {
+        steals += servers[i].steals;
+        most_steals = max(most_steals, servers[i].steals);
+        if (num_servers <= MAX_LISTED_SERVERS) {
+            fprintf(stdout, "\taverage time in Q2 for S%i = ", servers[i].num);
+            if (count[i] == 0) {
+                fprintf(stdout, "\"N/A\" no packet served");
+            } else {
+                fprintf(stdout, "%.6g", sum[i] / count[i] / MIC_TO_SEC);
+            }
+            if (steal_policy) {
+                fprintf(stdout, ", packets stolen = %lu", servers[i].steals);
+            }
+            fprintf(stdout, "\n");
+        }
+        if (count[i] == 0) { continue; }
+        double avg = sum[i] / count[i] / MIC_TO_SEC;
+        if (lo < 0.0 || avg < lo) { lo = avg; }
+        if (avg > hi) { hi = avg; }
+    }
+    if (hi >= 0.0) {
+        fprintf(stdout, "\taverage time in Q2 across servers = "
+                "[%.6g, %.6g], spread %.6g\n", lo, hi, hi - lo);
+    }
+    if (steal_policy) {
+        fprintf(stdout, "\tpackets stolen = %lu (most by one server %lu)\n",
+                steals, most_steals);
+    }
+    free(count);
+    free(sum);
+}
+
+void PrintStageRange(char *name, StatsSummary *summary) {
+    if (summary->count == 0) {
+        fprintf(stdout, "\t%s range = \"N/A\" no packets\n", name);
+    } else {
+        fprintf(stdout, "\t%s range = [%.6g, %.6g]\n", name,
+                summary->min / MIC_TO_SEC, summary->max / MIC_TO_SEC);
+    }
+}
+
+void PrintBands() {
+    /* Queueing delay by priority band, over served packets */
+    long count[PRIO_BANDS];
+    double q1[PRIO_BANDS], q2[PRIO_BANDS], wait[PRIO_BANDS], worst[PRIO_BANDS];
+    memset(count, 0, sizeof(count));
+    memset(q1, 0, sizeof(q1));
+    memset(q2, 0, sizeof(q2));
+    memset(wait, 0, sizeof(wait));
+    memset(worst, 0, sizeof(worst));
+    for (int p = 1; p <= pkts.capacity; ++p) {
+        if (pkts.fate[p] != FATE_SERVED) { continue; }
+        int b = pkts.band[p];
+        double before_service = pkts.service_begin[p] - pkts.arrival[p];
+        ++count[b];
+        q1[b] += pkts.q1_leave[p] - pkts.q1_enter[p];
+        q2[b] += pkts.q2_leave[p] - pkts.q2_enter[p];
+        wait[b] += before_service;
+        worst[b] = max(worst[b], before_service);
+    }
+    for (int b = 0; b < PRIO_BANDS; ++b) {
+        if (!(bands_seen & ((uint64_t) 1 << b))) { continue; }
+        if (count[b] == 0) {
+            fprintf(stdout, "\tband %i: \"N/A\" no packet served\n", b);
+            continue;
+        }
+        fprintf(stdout, "\tband %i: %ld served, average time in Q1 = %.6g, "
+                "in Q2 = %.6g, before service = %.6g (max %.6g)\n", b, count[b],
+                q1[b] / count[b] / MIC_TO_SEC, q2[b] / count[b] / MIC_TO_SEC,
+                wait[b] / count[b] / MIC_TO_SEC, worst[b] / MIC_TO_SEC);
+    }
+}
+
+void PrintStages() {
+    /* Per-stage breakdown of the time between arrival and Q2 */
+    if (Q1_stats.count == 0) {
+        fprintf(stdout, "\taverage time in stage 1 (Q1) = \"N/A\" no packets\n");
+    } else {
+        fprintf(stdout, "\taverage time in stage 1 (Q1) = %.6g\n",
+                Q1_stats.sum / Q1_stats.count / MIC_TO_SEC);
+    }
+    for (int i = 0; i < num_stages; ++i) {
+        Stage *stage = &stages[i];
+        if (stage->latency.count == 0) {
+            fprintf(stdout, "\taverage time in stage %i = \"N/A\" no packets",
+                    stage->num);
+        } else {
+            fprintf(stdout, "\taverage time in stage %i = %.6g, range = "
+                    "[%.6g, %.6g]", stage->num,
+                    stage->latency.sum / stage->latency.count / MIC_TO_SEC,
+                    stage->latency.min / MIC_TO_SEC,
+                    stage->latency.max / MIC_TO_SEC);
+        }
+        if (stage->accepted_tokens + stage->dropped_tokens > 0) {
+            fprintf(stdout, ", token drop probability = %.6g",
+                    (double) stage->dropped_tokens /
+                    (stage->accepted_tokens + stage->dropped_tokens));
+        }
+        fprintf(stdout, "\n");
+    }
+}
+
+void PrintCost(char *name, Cost *cost) {
+    if (cost->count == 0) {
+        fprintf(stdout, "\t%s = \"N/A\" never called\n", name);
+        return;
+    }
+    fprintf(stdout, "\t%s = %lu calls, average %.6gus, worst %.6gus, "
+            "total %.6gms\n", name, cost->count,
+            (double) cost->total / cost->count / 1000.0,
+            (double) cost->worst / 1000.0, (double) cost->total / 1e6);
+}
+
+void PrintCosts() {
+    static char *names[COST_EVENTS] = {
+        "PacketArrives()", "PacketEntersQ1()", "PacketLeavesQ1()",
+        "TokenArrives()", "PacketEntersQ2()", "PacketLeavesQ2()",
+        "BeginService()", "DepartService()"
+    };
+    for (int i = 0; i < COST_EVENTS; ++i) {
+        PrintCost(names[i], &event_costs[i]);
+    }
+    if (event_loop) { return; } /* one thread, mut is never taken */
+    fprintf(stdout, "\tmut acquisitions = %lu, contended = %lu\n",
+            mut_acquisitions, mut_wait.count);
+    if (mut_wait.count > 0) { PrintCost("mut wait", &mut_wait); }
+}
+
+void PrintRealtime() {
+    fprintf(stdout, "\treal-time threads = %i, pinned = %i, SCHED_FIFO = %i",
+            rt_threads, rt_pinned, rt_fifo);
+    if (rt_fifo < rt_threads) { fprintf(stdout, " (default scheduling)"); }
+    fprintf(stdout, ", memory %s\n", rt_locked ? "locked" : "not locked");
+}
+
+void PrintStatistics() {
+    ReduceStatistics();
+    fprintf(stdout, "Statistics:\n");
+    fprintf(stdout, "\n");
+
+    if (inter_arrival_stats.count == 0) {
+        fprintf(stdout,
+                "\taverage packet inter-arrival time = \"N/A\" no packet arrived\n");
+    } else {
+        fprintf(stdout, "\taverage packet inter-arrival time = %.6g\n", 
+                inter_arrival_stats.sum / inter_arrival_stats.count / MIC_TO_SEC);
+    }
+    if (service_stats.count == 0) {
+        fprintf(stdout,
+                "\taverage packet service time = \"N/A\" no packet served\n");
+    } else {
+        fprintf(stdout, "\taverage packet service time = %.6g\n", 
+                service_stats.sum / service_stats.count / MIC_TO_SEC);
+    }
+    fprintf(stdout, "\n");
+
+    fprintf(stdout, "\taverage number of packets in Q1 = %.6g\n", 
+            Q1_stats.sum / (emulation_end - emulation_begin));
+    fprintf(stdout, "\taverage number of packets in Q2 = %.6g\n", 
+            Q2_stats.sum / (emulation_end - emulation_begin));
+    PrintServerOccupancy();
+    fprintf(stdout, "\n");
+
+    if (system_stats.count == 0) {
+        fprintf(stdout,
+                "\taverage time a packet spent in system = \"N/A\" no packet served\n");
+        fprintf(stdout,
+                "\tstandard deviation for time spent in system = \"N/A\" no packet served\n");
+    } else {
+        double avg_x = system_stats.sum / system_stats.count;
+        double avg_x_sqr = system_stats.sum_sqr / system_stats.count;
+        fprintf(stdout, "\taverage time a packet spent in system = %.6g\n", 
+                avg_x / MIC_TO_SEC);
+        fprintf(stdout, "\tstandard deviation for time spent in system = %.6g\n", 
+                sqrt(max(avg_x_sqr - pow(avg_x, 2), 0.0)) / MIC_TO_SEC);
+    }
+    if (departure_stats.count == 0) {
+        fprintf(stdout,
+                "\taverage output inter-departure time = \"N/A\" fewer than two departures\n");
+    } else {
+        double avg_d = departure_stats.sum / departure_stats.count;
+        double avg_d_sqr = departure_stats.sum_sqr / departure_stats.count;
+        fprintf(stdout, "\taverage output inter-departure time = %.6g\n",
+                avg_d / MIC_TO_SEC);
+        fprintf(stdout, "\tstandard deviation for output inter-departure time = %.6g\n",
+                sqrt(max(avg_d_sqr - pow(avg_d, 2), 0.0)) / MIC_TO_SEC);
+    }
+    fprintf(stdout, "\n");
+
+    PrintStageRange("time in Q1", &Q1_stats);
+    PrintStageRange("time in Q2", &Q2_stats);
+    PrintServerQueueing();
+    PrintStageRange("service time", &service_stats);
+    PrintStageRange("time in system", &system_stats);
+    if (system_stats.count > 0) {
+        double width = (system_stats.max - system_stats.min) / SYSTEM_HIST_BUCKETS;
+        fprintf(stdout, "\ttime in system histogram:\n");
+        for (int i = 0; i < SYSTEM_HIST_BUCKETS; ++i) {
+            fprintf(stdout, "\t\t[%.6g, %.6g) = %ld\n",
+                    (system_stats.min + i * width) / MIC_TO_SEC,
+                    (system_stats.min + (i + 1) * width) / MIC_TO_SEC,
+                    system_hist[i]);
+        }
+    }
+    fprintf(stdout, "\tstatistics kernels = %s, reduction time = %.6gms\n",
+            StatsKernelName(), reduction_time);
+    fprintf(stdout, "\n");
+
+    if (dropped_tokens + accepted_tokens == 0) {
+        fprintf(stdout, "\tpacket drop probability = \"N/A\" no token arrived\n");
+    } else {
+        fprintf(stdout, "\ttoken drop probability = %.6g\n", 
+                (double) dropped_tokens / (dropped_tokens + accepted_tokens));
+    }
+    if (dropped_packets + completed_packets + removed_packets == 0) {
+        fprintf(stdout, "\tpacket drop probability = \"N/A\" no packet arrived\n");
+    } else {
+        fprintf(stdout, "\tpacket drop probability = %.6g\n", 
+                (double) dropped_packets
+                / (dropped_packets + completed_packets + removed_packets));
+    }
+    fprintf(stdout, "\n");
+
+    if (num_stages > 0) {
+        PrintStages();
+        fprintf(stdout, "\n");
+    }
+    if (bands_seen != 1) { /* some packet was not in band 0 */
+        PrintBands();
+        fprintf(stdout, "\n");
+    }
+
+    PrintBatchHistogram("Q1 to Q2 transfer batch sizes", transfer_batches);
+    PrintBatchHistogram("server claim batch sizes", claim_batches);
+    fprintf(stdout, "\n");
+
+    PrintDrift("packet arrival", &arrival_drift);
+    PrintDrift("token arrival", &token_drift);
+    PrintDrift("service completion", &service_drift);
+    if (edt_pacing) { PrintDrift("paced departure", &pace_drift); }
+    if (rt_num_cpus) { PrintRealtime(); }
+    if (OccupancyLogEnabled()) {
+        fprintf(stdout, "\toccupancy samples = %lu, overwritten = %lu\n",
+                OccupancyLogCount(), OccupancyLogOverwritten());
+    }
+    fprintf(stdout, "\n");
+
+    if (cost_counters) {
+        PrintCosts();
+        fprintf(stdout, "\n");
+    }
+
+    fprintf(stdout, "\tserver wakeups (futex wakes) = %lu\n", wakeups_issued);
+    fprintf(stdout, "\twasted server wakeups = %lu\n", wasted_wakeups);
+    if (coro_threads) {
+        fprintf(stdout, "\tcoroutine switches = %lu\n", CoroSwitches());
+    }
+    fprintf(stdout, "\tvoluntary context switches = %ld\n",
+            usage_end.ru_nvcsw - usage_begin.ru_nvcsw);
+    fprintf(stdout, "\tinvoluntary context switches = %ld\n",
+            usage_end.ru_nivcsw - usage_begin.ru_nivcsw);
+
+    /* Arrivals, tokens and completions each cost one wakeup */
+    long events = inter_arrival_stats.count + accepted_tokens +
+                  dropped_tokens + completed_packets;
+    double cpu_time =
+        (usage_end.ru_utime.tv_sec - usage_begin.ru_utime.tv_sec +
+         usage_end.ru_stime.tv_sec - usage_begin.ru_stime.tv_sec) * (double) SEC_TO_MIC +
+        (usage_end.ru_utime.tv_usec - usage_begin.ru_utime.tv_usec +
+         usage_end.ru_stime.tv_usec - usage_begin.ru_stime.tv_usec);
+    if (events == 0) {
+        fprintf(stdout, "\tCPU time per event = \"N/A\" no events\n");
+    } else {
+        fprintf(stdout, "\tCPU time per event = %.6gms (%ld events)\n",
+                cpu_time / events / MIC_TO_MIL, events);
+    }
+}
+
+/* ----------------------- First Procedures ----------------------- */
+
+void *monitor(void *arg) {
+    int sig = 0;
 
     for(;;) {
         sigwait(&set, &sig);
-        pthread_mutex_lock(&mut);
+        LockMut();
         time_to_quit = TRUE;
         pthread_cancel(packet_thread);
-        pthread_cancel(token_thread);
+        if (!edt_pacing) { pthread_cancel(token_thread); }
         struct timeval tv;
         PrintTime(GetTime(&tv));
+        LogEvent(EV_SIGINT, current_time, 0, 0, 0, 0);
         fprintf(stdout,
                 "SIGINT caught, no new packets or tokens will be allowed\n");
-        pthread_cond_broadcast(&cv);
+        WakeAllServers();
+        for (int i = 0; i < num_stages; ++i) {
+            StageQueueKick(&stages[i].queue);
+        }
         pthread_mutex_unlock(&mut);
         break;
     }
     return (void *) 0;
 }
 
+void AdmitPacket(int p, unsigned long *last_arrival_time) {
+    /* Caller holds mut; drops the packet or appends it to Q1 */
+    PacketArrives(p, last_arrival_time);
+
+    if (pkts.tokens_required[p] > B) {
+        ++dropped_packets;
+        LogEvent(EV_PACKET_DROPPED, pkts.arrival[p], p, 0, 0, 0);
+        QDISC_PROBE1(packet__drop, p);
+        fprintf(stdout, ", dropped\n");
+        pkts.fate[p] = FATE_DROPPED;
+        FreePacket(p);
+    } else if (edt_pacing) { /* no tokens; the departure time shapes */
+        fprintf(stdout, "\n");
+        double due = max((double) pkts.arrival[p], pace_next);
+        pkts.departure_due[p] = (unsigned long) (due + 0.5);
+        pace_next = due + pkts.tokens_required[p] * pace_interval;
+        MoveToQ2(p);
+        WakeServers(1);
+    } else {
+        fprintf(stdout, "\n");
+        PrioQueueAppend(&Q1, p, pkts.band[p]);
+        PacketEntersQ1(p);
+    }
+}
+
+void NextPacket(FILE *fp, int p) {
+    if (!*buf) { /* deterministic mode */
+        pkts.inter_arrival_requested[p] = l;
+        pkts.tokens_required[p] = P;
+        pkts.service_time_requested[p] = m;
+    } else {          /* trace-driven mode */
+        if (fgets(buf, sizeof(buf), fp) != NULL) {
+            LineTooLong(p + 1); /* Checks if line is too long */
+            int band;
+            ReadLine(&(pkts.inter_arrival_requested[p]),
+                     &(pkts.tokens_required[p]),
+                     &(pkts.service_time_requested[p]),
+                     &band, p + 1);
+            pkts.band[p] = (unsigned char) band;
+            bands_seen |= (uint64_t) 1 << band;
+        } else { 
+            fprintf(stderr, "error in the input - reached EOF earlier than expected\n");
+            exit(1);
+        }
+    }
+}
+
 void *packet_thread_func(void *arg) {
     int oldstate;
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
@@ -575,69 +1812,78 @@ void *packet_thread_func(void *arg) {
     FILE *fp = (FILE *) arg;
     int p_num = 0; /* Variable to count number of packets */
     unsigned long last_arrival_time = emulation_begin;
+    unsigned long arrival_due = emulation_begin; /* drift does not accumulate */
+    double arrival_next = emulation_begin; /* arrival_due before rounding */
     
     for (; n > 0; --n) {
-        ++p_num;
-        Packet *packet = (Packet *) malloc(sizeof(Packet));
-        packet->num = p_num;
-
-        if (!*buf) { /* deterministic mode */
-            packet->inter_arrival_time = l;
-            packet->tokens_required = P;
-            packet->service_time_requested = m;
-        } else {          /* trace-driven mode */
-            if (fgets(buf, sizeof(buf), fp) != NULL) {
-                LineTooLong(packet->num + 1); /* Checks if line is too long */
-                ReadLine(&(packet->inter_arrival_time),
-                         &(packet->tokens_required),
-                         &(packet->service_time_requested),
-                         packet->num + 1);
-            } else { 
-                fprintf(stderr, "error in the input - reached EOF earlier than expected\n");
-                exit(1);
-            }
-        }
+        int p = ++p_num;
+        NextPacket(fp, p);
 
+        arrival_next += ScaleTimeExact(pkts.inter_arrival_requested[p]);
+        arrival_due = (unsigned long) (arrival_next + 0.5);
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
-        struct timeval tv;
-        unsigned long curr_time = GetTime(&tv);
-        /* Simulate passage of time with usleep() */
-        if (last_arrival_time + (packet->inter_arrival_time * MIL_TO_MIC) 
-            > curr_time)
-        {
-            usleep(last_arrival_time + (packet->inter_arrival_time * MIL_TO_MIC)
-                   - curr_time);
-        }
+        SleepUntil(arrival_due);
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-        pthread_mutex_lock(&mut);
+        LockMut();
         if (time_to_quit) {
-            free(packet);
             pthread_mutex_unlock(&mut);
             return (void *) 1;
         }
-        PacketArrives(packet, &last_arrival_time);
-        
+        AdmitPacket(p, &last_arrival_time);
+        RecordDrift(&arrival_drift, last_arrival_time, arrival_due);
+        if (PrioQueueFirst(&Q1) == p) { /* new head of Q1 */
+            CheckQ1();
+        }
+        pthread_mutex_unlock(&mut);
+    }
+    LockMut();
+    all_packets_arrived = TRUE;
+    WakeAllServers();
+    pthread_mutex_unlock(&mut);
+    return (void *) 2;
+}
 
-        avg_inter_arrival_time = (avg_inter_arrival_time * (p_num - 1) + 
-                                  packet->inter_arrival_time) / (p_num);
+void *udp_thread_func(void *arg) {
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-        if (packet->tokens_required > B) {
-            ++dropped_packets;
-            fprintf(stdout, ", dropped\n");
-            free(packet);
-        } else {
-            fprintf(stdout, "\n");
-            MyListAppend(&Q1, packet);
-            PacketEntersQ1(packet);
-            if (MyListLength(&Q1) == 1) {
-                CheckQ1();
-            }
+    int p_num = 0; /* Variable to count number of packets */
+    unsigned long last_arrival_time = emulation_begin;
+    int slots[UDP_BATCH];
+    int lens[UDP_BATCH];
+
+    while (n > 0) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
+        int received = UdpRecvBatch(udp_fd, slots, lens, (int) min(n, UDP_BATCH));
+        if (received == 0) {
+            usleep(100); /* every slot is queued inside the shaper */
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+        LockMut();
+        if (time_to_quit) {
+            for (int i = 0; i < received; ++i) { UdpReleaseSlot(slots[i]); }
+            pthread_mutex_unlock(&mut);
+            return (void *) 1;
+        }
+        for (int i = 0; i < received; ++i, --n) {
+            int p = ++p_num;
+            pkts.tokens_required[p] = P;
+            pkts.service_time_requested[p] = m;
+            pkts.slot[p] = slots[i];
+            pkts.length[p] = lens[i];
+            AdmitPacket(p, &last_arrival_time);
+        }
+        if (received > 0 && !PrioQueueEmpty(&Q1)) {
+            CheckQ1();
         }
         pthread_mutex_unlock(&mut);
     }
+    LockMut();
     all_packets_arrived = TRUE;
-    pthread_cond_broadcast(&cv);
+    WakeAllServers();
+    pthread_mutex_unlock(&mut);
     return (void *) 2;
 }
 
@@ -647,88 +1893,516 @@ void *token_thread_func(void *arg) {
 
     int t_num = 0; /* Variable to count number of tokens */
     unsigned long last_token_time = emulation_begin;
+    unsigned long token_due = emulation_begin;
+    double token_next = emulation_begin; /* token_due before rounding */
 
-    while (!all_packets_arrived || !MyListEmpty(&Q1)) {
+    while (!all_packets_arrived || !PrioQueueEmpty(&Q1)) {
         ++t_num;
 
+        token_next += r;
+        token_due = (unsigned long) (token_next + 0.5);
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
-        struct timeval tv;
-        unsigned long curr_time = GetTime(&tv);
-        /* Simulate passage of time with usleep() */
-        if (last_token_time + (r * MIL_TO_MIC) > curr_time) {
-            usleep(last_token_time + (r * MIL_TO_MIC) - curr_time);
-        }
+        SleepUntil(token_due);
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-        pthread_mutex_lock(&mut);
+        LockMut();
         if (time_to_quit) {
             pthread_mutex_unlock(&mut);
             return (void *) 1;
         }
         
-        if (all_packets_arrived && MyListEmpty(&Q1)) {
+        if (all_packets_arrived && PrioQueueEmpty(&Q1)) {
             pthread_mutex_unlock(&mut);
             break;
         }
 
         TokenArrives(t_num, &last_token_time);
+        RecordDrift(&token_drift, last_token_time, token_due);
 
-        if (!MyListEmpty(&Q1)) {
+        if (!PrioQueueEmpty(&Q1)) {
             CheckQ1();
         }
         pthread_mutex_unlock(&mut);
     }
-    pthread_cond_broadcast(&cv);
+    LockMut();
+    WakeAllServers();
+    pthread_mutex_unlock(&mut);
     return (void *) 2;
 }
 
-void *server_thread_func(void *arg) {
-    int *s_num = (int *) arg;
+void TakeSample(unsigned long time) {
+    /* Caller holds mut */
+    OccupancySample sample;
+    sample.time = time - emulation_begin;
+    sample.q1_len = PrioQueueLength(&Q1);
+    sample.q2_len = Q2Length();
+    sample.bucket = token_bucket;
+    sample.busy = busy_servers;
+    OccupancyLogRecord(&sample);
+}
+
+unsigned long NextSampleDue(unsigned long due, unsigned long now) {
+    /* Samples missed while the sampler was late are skipped, not bunched */
+    do {
+        due += sample_interval;
+    } while (due <= now);
+    return due;
+}
+
+void *sample_thread_func(void *arg) {
+    /* Runs until Process() sets sampling_done once every server has returned */
+    unsigned long sample_due = emulation_begin;
+    LockMut();
+    while (!sampling_done) {
+        struct timeval tv;
+        if (GetTime(&tv) >= sample_due) {
+            TakeSample(current_time);
+            sample_due = NextSampleDue(sample_due, current_time);
+            continue;
+        }
+        /* Same clock as GetTime(); mut is released while waiting */
+        struct timespec ts;
+        ts.tv_sec = sample_due / SEC_TO_MIC;
+        ts.tv_nsec = (sample_due % SEC_TO_MIC) * 1000UL;
+        pthread_cond_timedwait(&sample_cv, &mut, &ts);
+    }
+    pthread_mutex_unlock(&mut);
+    return (void *) 0;
+}
+
+int StageUpstreamDone(Stage *stage) {
+    /* Caller holds mut; TRUE once no more packets will enter the stage */
+    if (stage == &stages[0]) {
+        return all_packets_arrived && PrioQueueEmpty(&Q1);
+    }
+    return (stage - 1)->done;
+}
+
+void *stage_thread_func(void *arg) {
+    Stage *stage = (Stage *) arg;
+    int t_num = 0; /* Variable to count this stage's tokens */
+    double token_next = emulation_begin + stage->r; /* token_due before rounding */
+    unsigned long token_due = (unsigned long) (token_next + 0.5);
 
     for (;;) {
-        pthread_mutex_lock(&mut);
+        LockMut();
+        if (time_to_quit) { /* Signal caught; empty the stage and stop */
+            StageRemovePackets(stage);
+            break;
+        }
+        struct timeval tv;
+        if (GetTime(&tv) >= token_due) {
+            StageTokenArrives(stage, ++t_num);
+            token_next += stage->r;
+            token_due = (unsigned long) (token_next + 0.5);
+        }
+        StageForward(stage);
+        if (StageUpstreamDone(stage) && StageQueuePeek(&stage->queue) == NULL) {
+            break;
+        }
+        if (StageQueuePeek(&stage->queue) != NULL) {
+            /* head waits for tokens or for room downstream */
+            pthread_mutex_unlock(&mut);
+            SleepUntil(token_due);
+        } else {
+            StageQueueWait(&stage->queue, &mut, token_due);
+            pthread_mutex_unlock(&mut);
+        }
+    }
+    stage->done = TRUE;
+    WakeAllServers(); /* after the last stage, servers may exit */
+    pthread_mutex_unlock(&mut);
+    return (void *) 2;
+}
 
-        while (!time_to_quit && MyListEmpty(&Q2) &&
-              (!MyListEmpty(&Q1) || !all_packets_arrived))
-        {
-            pthread_cond_wait(&cv, &mut);
+void PaceDeparture(int p) {
+    /*
+     * Caller holds mut.  A claimed packet stays in Q2 until its departure
+     * time; sleep in PACE_CHECK slices so SIGINT is noticed.
+     */
+    struct timeval tv;
+    while (!time_to_quit && GetTime(&tv) < pkts.departure_due[p]) {
+        unsigned long until = min(pkts.departure_due[p], current_time + PACE_CHECK);
+        pthread_mutex_unlock(&mut);
+        SleepUntil(until);
+        LockMut();
+    }
+    if (!time_to_quit) {
+        PacketLeavesQ2(p);
+        RecordDrift(&pace_drift, pkts.q2_leave[p], pkts.departure_due[p]);
+    }
+}
+
+int PacketsUpstream() {
+    /* Caller holds mut; TRUE while packets may still reach Q2 */
+    return !all_packets_arrived || !PrioQueueEmpty(&Q1) || in_pipeline > 0;
+}
+
+void *server_thread_func(void *arg) {
+    ServerSlot *slot = (ServerSlot *) arg;
+    int *batch = (int *) malloc(batch_max * sizeof(int));
+
+    for (;;) {
+        LockMut();
+
+        while (!time_to_quit && Q2Length() == 0 && PacketsUpstream()) {
+            ServerWait(slot);
+            if (!slot->idle && !time_to_quit && Q2Length() == 0 &&
+                PacketsUpstream())
+            {
+                ++wasted_wakeups;
+            }
         }
+        ServerUnpark(slot);
 
         if (time_to_quit) { /* Signal caught; time to terminate program */
-            pthread_cond_broadcast(&cv);
+            WakeAllServers();
             SigQuit();
             pthread_mutex_unlock(&mut);
+            free(batch);
             return (void *) 1;
-        } else if (all_packets_arrived && MyListEmpty(&Q1) && 
-                   MyListEmpty(&Q2))
-        { /* No more packets to service; time to terminate program */
-            pthread_cond_broadcast(&cv);
+        } else if (!PacketsUpstream() && Q2Length() == 0) {
+            /* No more packets to service; time to terminate program */
+            WakeAllServers();
             pthread_mutex_unlock(&mut);
+            free(batch);
             return (void *) 2;
         } else {
-            if (!MyListEmpty(&Q2)) {
-                Packet *p = CheckQ2();
-                BeginService(p, *s_num);
+            if (Q2Length() > 0) {
+                int claimed = CheckQ2(slot, batch);
+                int departed = 0;
+
+                for (int i = 0; i < claimed; ++i) {
+                    int p = batch[i];
+                    if (edt_pacing) {
+                        PaceDeparture(p);
+                    } else if (!time_to_quit) { /* batch-mates wait in Q2 */
+                        PacketLeavesQ2(p);
+                    }
+                    if (time_to_quit) { /* Drop the rest of the batch */
+                        struct timeval tv;
+                        PrintTime(GetTime(&tv));
+                        LogEvent(EV_PACKET_REMOVED, current_time, p,
+                                 slot->num, 0, 2);
+                        fprintf(stdout, "p%i removed from Q2\n", p);
+                        pkts.fate[p] = FATE_REMOVED;
+                        FreePacket(p);
+                        ++removed_packets;
+                        continue;
+                    }
+                    BeginService(p, slot->num);
+
+                    struct timeval tv;
+                    unsigned long curr_time = GetTime(&tv);
+                    unsigned long service_due = pkts.service_begin[p] +
+                                        ScaleTime(pkts.service_time_requested[p]);
+                    if (service_due > curr_time) {
+                        pthread_mutex_unlock(&mut);
+                        SleepUntil(service_due);
+                        LockMut();
+                    }
+
+                    DepartService(p, slot);
+                    RecordDrift(&service_drift, pkts.service_end[p], service_due);
+                    batch[departed++] = p;
+                }
+                pthread_mutex_unlock(&mut);
+                ForwardPackets(batch, departed);
+            } else {
+                pthread_mutex_unlock(&mut);
+            }
+        }
+    }
+    free(batch);
+    return (void *) 2;
+}
 
-                struct timeval tv;
-                unsigned long curr_time = GetTime(&tv);
-                /* Simulate passage of time with usleep() */
-                if (p->enter_time + (p->service_time_requested * MIL_TO_MIC) 
-                    > curr_time)
+void ServerCoroutine(void *arg) {
+    server_thread_func(arg);
+}
+
+/* ----------------------- Event-Loop Runtime ----------------------- */
+
+#ifdef __linux__
+
+/* epoll data identifying each event source */
+#define EPOLL_PACKET  0U
+#define EPOLL_TOKEN  1U
+#define EPOLL_SIGNAL  2U
+#define EPOLL_SAMPLE  3U
+#define EPOLL_SERVER  4U /* + server index */
+
+void ArmTimer(int fd, unsigned long deadline) {
+    /* Absolute CLOCK_REALTIME deadline, same clock as GetTime(); 0 disarms */
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (deadline > 0) {
+        its.it_value.tv_sec = deadline / SEC_TO_MIC;
+        its.it_value.tv_nsec = (deadline % SEC_TO_MIC) * MIL_TO_MIC;
+    }
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int EventLoopNextService(ServerSlot *slot) {
+    /* Begins the next claimed packet; FALSE once the batch is used up */
+    while (slot->next < slot->claimed) {
+        int p = slot->batch[slot->next];
+        if (time_to_quit) { /* Drop the rest of the batch */
+            struct timeval tv;
+            PrintTime(GetTime(&tv));
+            LogEvent(EV_PACKET_REMOVED, current_time, p, slot->num, 0, 2);
+            fprintf(stdout, "p%i removed from Q2\n", p);
+            pkts.fate[p] = FATE_REMOVED;
+            FreePacket(p);
+            ++removed_packets;
+            ++slot->next;
+            continue;
+        }
+        PacketLeavesQ2(p); /* batch-mates wait in Q2 until now */
+        BeginService(p, slot->num);
+        slot->service_due = pkts.service_begin[p] +
+                            ScaleTime(pkts.service_time_requested[p]);
+        ArmTimer(slot->timer_fd, max(slot->service_due, 1UL));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+void EventLoopStartServer(ServerSlot *slot) {
+    /* Server just left the idle stack: claim work or go back on it */
+    if (!time_to_quit && Q2Length() > 0) {
+        slot->claimed = CheckQ2(slot, slot->batch);
+        slot->next = 0;
+        if (EventLoopNextService(slot)) { return; }
+    }
+    IdlePush(slot);
+}
+
+void EventLoop(FILE *fp) {
+    /*
+     * Drives packet arrivals, token arrivals and service completions from
+     * timerfds, and SIGINT from a signalfd, on the calling thread.  The
+     * same event functions as the threaded runtime are used, so the log
+     * and the statistics are identical; no locking is needed.
+     */
+    int epfd = epoll_create1(0);
+    int packet_fd = timerfd_create(CLOCK_REALTIME, 0);
+    int token_fd = timerfd_create(CLOCK_REALTIME, 0);
+    int signal_fd = signalfd(-1, &set, 0);
+    int sample_fd = timerfd_create(CLOCK_REALTIME, 0);
+    if (epfd < 0 || packet_fd < 0 || token_fd < 0 || signal_fd < 0 ||
+        sample_fd < 0)
+    {
+        perror("epoll");
+        exit(1);
+    }
+    if (speed > 1.0) {
+        prctl(PR_SET_TIMERSLACK, 1UL); /* timerfds fire without slack */
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = EPOLL_PACKET;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, packet_fd, &ev);
+    ev.data.u32 = EPOLL_TOKEN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, token_fd, &ev);
+    ev.data.u32 = EPOLL_SIGNAL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, signal_fd, &ev);
+    ev.data.u32 = EPOLL_SAMPLE;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sample_fd, &ev);
+    for (int i = 0; i < num_servers; ++i) {
+        servers[i].timer_fd = timerfd_create(CLOCK_REALTIME, 0);
+        if (servers[i].timer_fd < 0) {
+            perror("timerfd");
+            exit(1);
+        }
+        servers[i].batch = (int *) malloc(batch_max * sizeof(int));
+        ev.data.u32 = EPOLL_SERVER + i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, servers[i].timer_fd, &ev);
+    }
+    for (int i = (int) num_servers - 1; i >= 0; --i) { /* S1 on top */
+        IdlePush(&servers[i]);
+    }
+
+    int p_num = 0; /* Variable to count number of packets */
+    int t_num = 0; /* Variable to count number of tokens */
+    unsigned long last_arrival_time = emulation_begin;
+    unsigned long arrival_due = emulation_begin;
+    double arrival_next = emulation_begin; /* arrival_due before rounding */
+    unsigned long last_token_time = emulation_begin;
+    unsigned long token_due = emulation_begin;
+    double token_next = emulation_begin; /* token_due before rounding */
+    int tokens_active = TRUE;
+
+    if (n > 0) {
+        NextPacket(fp, ++p_num);
+        arrival_next += ScaleTimeExact(pkts.inter_arrival_requested[p_num]);
+        arrival_due = (unsigned long) (arrival_next + 0.5);
+        ArmTimer(packet_fd, arrival_due);
+    } else {
+        all_packets_arrived = TRUE;
+    }
+    token_next += r;
+    token_due = (unsigned long) (token_next + 0.5);
+    ArmTimer(token_fd, token_due);
+    unsigned long sample_due = emulation_begin;
+    if (OccupancyLogEnabled()) {
+        struct timeval tv;
+        TakeSample(GetTime(&tv));
+        sample_due = NextSampleDue(sample_due, current_time);
+        ArmTimer(sample_fd, sample_due);
+    }
+
+    struct epoll_event events[64];
+    for (;;) {
+        /* Same exit condition as joining every thread */
+        if (idle_top == num_servers && !tokens_active &&
+            (time_to_quit || (all_packets_arrived && PrioQueueEmpty(&Q1) &&
+                              Q2Length() == 0)))
+        {
+            break;
+        }
+
+        int count = epoll_wait(epfd, events, 64, -1);
+        for (int e = 0; e < count; ++e) {
+            unsigned int id = events[e].data.u32;
+            uint64_t expirations;
+
+            if (id == EPOLL_SIGNAL) {
+                struct signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) != sizeof(info) ||
+                    time_to_quit)
                 {
-                    pthread_mutex_unlock(&mut);
-                    usleep(p->enter_time + (p->service_time_requested * MIL_TO_MIC)
-                           - curr_time);
-                    pthread_mutex_lock(&mut);
+                    continue;
                 }
+                time_to_quit = TRUE;
+                tokens_active = FALSE;
+                ArmTimer(packet_fd, 0UL);
+                ArmTimer(token_fd, 0UL);
+                struct timeval tv;
+                PrintTime(GetTime(&tv));
+                LogEvent(EV_SIGINT, current_time, 0, 0, 0, 0);
+                fprintf(stdout,
+                        "SIGINT caught, no new packets or tokens will be allowed\n");
+                SigQuit();
+                continue;
+            }
 
-                DepartService(p, *s_num);
-                pthread_mutex_unlock(&mut);
-                free(p);
+            if (id == EPOLL_SAMPLE) {
+                if (read(sample_fd, &expirations, sizeof(expirations)) < 0) {
+                    continue;
+                }
+                struct timeval tv;
+                TakeSample(GetTime(&tv));
+                sample_due = NextSampleDue(sample_due, current_time);
+                ArmTimer(sample_fd, sample_due);
+                continue;
+            }
+
+            if (id == EPOLL_PACKET) {
+                if (read(packet_fd, &expirations, sizeof(expirations)) < 0 ||
+                    time_to_quit || all_packets_arrived)
+                {
+                    continue;
+                }
+                AdmitPacket(p_num, &last_arrival_time);
+                RecordDrift(&arrival_drift, last_arrival_time, arrival_due);
+                if (PrioQueueFirst(&Q1) == p_num) { /* new head of Q1 */
+                    CheckQ1();
+                }
+                if (--n > 0) {
+                    NextPacket(fp, ++p_num);
+                    arrival_next += ScaleTimeExact(pkts.inter_arrival_requested[p_num]);
+                    arrival_due = (unsigned long) (arrival_next + 0.5);
+                    ArmTimer(packet_fd, arrival_due);
+                } else {
+                    all_packets_arrived = TRUE;
+                }
+            } else if (id == EPOLL_TOKEN) {
+                if (read(token_fd, &expirations, sizeof(expirations)) < 0 ||
+                    !tokens_active)
+                {
+                    continue;
+                }
+                if (all_packets_arrived && PrioQueueEmpty(&Q1)) {
+                    tokens_active = FALSE;
+                    continue;
+                }
+                TokenArrives(++t_num, &last_token_time);
+                RecordDrift(&token_drift, last_token_time, token_due);
+                if (!PrioQueueEmpty(&Q1)) {
+                    CheckQ1();
+                }
+                token_next += r;
+                token_due = (unsigned long) (token_next + 0.5);
+                ArmTimer(token_fd, token_due);
+            } else {
+                ServerSlot *slot = &servers[id - EPOLL_SERVER];
+                if (read(slot->timer_fd, &expirations, sizeof(expirations)) < 0 ||
+                    slot->next >= slot->claimed)
+                {
+                    continue;
+                }
+                int p = slot->batch[slot->next++];
+                DepartService(p, slot);
+                RecordDrift(&service_drift, pkts.service_end[p], slot->service_due);
+                if (!EventLoopNextService(slot)) {
+                    EventLoopStartServer(slot);
+                }
             }
         }
     }
-    return (void *) 2;
+
+    for (int i = 0; i < num_servers; ++i) {
+        close(servers[i].timer_fd);
+        free(servers[i].batch);
+    }
+    close(sample_fd);
+    close(signal_fd);
+    close(token_fd);
+    close(packet_fd);
+    close(epfd);
+}
+
+#else /* ~__linux__ */
+
+void EventLoopStartServer(ServerSlot *slot) {
+}
+
+void EventLoop(FILE *fp) {
+    fprintf(stderr, "error - the epoll runtime requires Linux\n");
+    exit(1);
+}
+
+#endif /* __linux__ */
+
+/* ----------------------- Real-time Setup ----------------------- */
+
+void RealtimeThread(pthread_t thread, int priority) {
+    /* Next CPU in the -rt list; without privilege the thread keeps SCHED_OTHER */
+    int cpu = rt_cpus[rt_threads % rt_num_cpus];
+    ++rt_threads;
+    if (RealtimePin(thread, cpu)) { ++rt_pinned; }
+    if (RealtimeFifo(thread, priority)) { ++rt_fifo; }
+}
+
+void RealtimeServerThread(pthread_t thread) {
+    RealtimeThread(thread, RT_PRIORITY_SERVER);
+}
+
+void RealtimeMemory() {
+    /* Lock first so the pages faulted in below stay resident */
+    rt_locked = RealtimeLockMemory();
+    PacketStorePrefault(&pkts);
+    if (udp_in_port) { UdpPoolPrefault(); }
+    if (edt_pacing) {
+        RealtimePrefault(Q2_heap.nums, ((size_t) n + 1) * sizeof(int));
+    }
+    for (int i = 0; i < num_stages; ++i) {
+        RealtimePrefault(stages[i].queue.entries,
+                         (stages[i].queue.mask + 1) * sizeof(StageEntry));
+    }
 }
 
 /* ----------------------- Process() ----------------------- */
@@ -756,33 +2430,182 @@ void Process() {
         }
     }
 
+    if (coro_threads && event_loop) {
+        fprintf(stderr, "error in the input - coro requires the threaded runtime\n");
+        exit(1);
+    }
+    if (edt_pacing && (event_loop || steal_policy || num_stages > 0)) {
+        fprintf(stderr, "error in the input - pace requires the threaded "
+                "runtime, one shared Q2 and a single stage\n");
+        exit(1);
+    }
+    if (num_stages > 0 && event_loop) {
+        fprintf(stderr, "error in the input - stage requires the threaded runtime\n");
+        exit(1);
+    }
+    if (udp_in_port) {
+        if (event_loop) {
+            fprintf(stderr, "error in the input - udp requires the threaded runtime\n");
+            exit(1);
+        }
+        if (*buf) {
+            fprintf(stderr, "error in the input - udp and tsfile are exclusive\n");
+            exit(1);
+        }
+        udp_fd = UdpOpen(udp_in_port);
+        if (udp_fd < 0) {
+            perror("udp");
+            exit(1);
+        }
+        if (!UdpPoolInit(UDP_SLOTS)) {
+            fprintf(stderr, "error - cannot allocate UDP slots\n");
+            exit(1);
+        }
+    }
+
+    if (!PacketStoreInit(&pkts, (int) n)) {
+        fprintf(stderr, "error - cannot allocate records for %ld packets\n", n);
+        exit(1);
+    }
+    PrioQueueInit(&Q1, pkts.next);
+    PrioQueueInit(&Q2, pkts.next);
+
+    for (int i = 0; i < num_stages; ++i) {
+        if (!StageQueueInit(&stages[i].queue, STAGE_QUEUE_SIZE)) {
+            fprintf(stderr, "error - cannot allocate stage %i\n", stages[i].num);
+            exit(1);
+        }
+    }
+
+    if (edt_pacing && !PacketHeapInit(&Q2_heap, (int) n, pkts.departure_due)) {
+        fprintf(stderr, "error - cannot allocate the departure heap\n");
+        exit(1);
+    }
+
+    if (*trace_path && !EventLogOpen(trace_path, (int) num_servers)) {
+        perror(trace_path);
+        exit(1);
+    }
+
+    if (*sample_path && !OccupancyLogOpen(sample_path, OCCUPANCY_RING_SIZE)) {
+        perror(sample_path);
+        exit(1);
+    }
+
     PrintParams();
     ConvertParams();
-    PrintEmulationBegins();
+    InitServers();
+    if (rt_num_cpus) { RealtimeMemory(); } /* not charged to the first events */
     void *result = (void *) 0; /* To capture child thread return code */
-    int server_one = 1;
-    int server_two = 2;
-
-    /* Create four threads */
-    pthread_create(&packet_thread, NULL, packet_thread_func, fp);
-    pthread_create(&token_thread, NULL, token_thread_func, 0);
-    pthread_create(&server_one_thread, NULL, server_thread_func, &server_one);
-    pthread_create(&server_two_thread, NULL, server_thread_func, &server_two);
-    
-    /* Join four threads */
-    pthread_join(packet_thread, (void **) &result);
-    pthread_join(token_thread, (void **) &result);
-    pthread_join(server_one_thread, (void **) &result);
-    pthread_join(server_two_thread, (void **) &result);
+    getrusage(RUSAGE_SELF, &usage_begin);
+    PrintEmulationBegins();
+
+    if (event_loop) {
+        if (rt_num_cpus) { RealtimeThread(pthread_self(), RT_PRIORITY_TIMER); }
+        EventLoop(fp);
+    } else {
+        /* Create packet, token and server threads */
+        pthread_create(&packet_thread, NULL,
+                       udp_in_port ? udp_thread_func : packet_thread_func, fp);
+        if (rt_num_cpus) { RealtimeThread(packet_thread, RT_PRIORITY_TIMER); }
+        if (!edt_pacing) { /* pacing needs no token wakeups */
+            pthread_create(&token_thread, NULL, token_thread_func, 0);
+            if (rt_num_cpus) { RealtimeThread(token_thread, RT_PRIORITY_TIMER); }
+        }
+        for (int i = 0; i < num_stages; ++i) {
+            pthread_create(&stages[i].thread, NULL, stage_thread_func,
+                           &stages[i]);
+            if (rt_num_cpus) {
+                RealtimeThread(stages[i].thread, RT_PRIORITY_TIMER);
+            }
+        }
+        if (OccupancyLogEnabled()) { /* left at default priority under -rt */
+            pthread_create(&sample_thread, NULL, sample_thread_func, 0);
+        }
+        if (coro_threads) {
+            /* Servers run as coroutines until every one of them returns */
+            if (!CoroSchedInit((int) coro_threads)) {
+                fprintf(stderr, "error - cannot create coroutine schedulers\n");
+                exit(1);
+            }
+            for (int i = 0; i < num_servers; ++i) {
+                servers[i].coro = CoroCreate(ServerCoroutine, &servers[i]);
+                if (servers[i].coro == NULL) {
+                    fprintf(stderr, "error - cannot create server coroutine\n");
+                    exit(1);
+                }
+            }
+            CoroRunAll(rt_num_cpus ? RealtimeServerThread : NULL);
+        } else {
+            for (int i = 0; i < num_servers; ++i) {
+                pthread_create(&servers[i].thread, NULL, server_thread_func,
+                               &servers[i]);
+                if (rt_num_cpus) {
+                    RealtimeThread(servers[i].thread, RT_PRIORITY_SERVER);
+                }
+            }
+        }
+        
+        /* Join packet, token and server threads */
+        pthread_join(packet_thread, (void **) &result);
+        if (!edt_pacing) { pthread_join(token_thread, (void **) &result); }
+        for (int i = 0; i < num_stages; ++i) {
+            pthread_join(stages[i].thread, (void **) &result);
+        }
+        for (int i = 0; i < num_servers && !coro_threads; ++i) {
+            pthread_join(servers[i].thread, (void **) &result);
+        }
+        if (OccupancyLogEnabled()) {
+            LockMut();
+            sampling_done = TRUE;
+            pthread_cond_signal(&sample_cv);
+            pthread_mutex_unlock(&mut);
+            pthread_join(sample_thread, (void **) &result);
+        }
+    }
+    getrusage(RUSAGE_SELF, &usage_end);
     
     if (fp != NULL) { fclose(fp); }
+    if (udp_fd >= 0) {
+        close(udp_fd);
+        UdpPoolFree();
+    }
 
     PrintEmulationEnds();
+    EventLogClose();
     PrintStatistics();
+    if (!OccupancyLogClose(sample_interval)) { perror(sample_path); }
+
+    if (*export_path) {
+        FILE *export_fp = fopen(export_path, "w");
+        if (export_fp == NULL ||
+            !PacketStoreExport(&pkts, export_fp, emulation_begin))
+        {
+            perror(export_path);
+        }
+        if (export_fp != NULL) { fclose(export_fp); }
+    }
+}
+
+void Cleanup() {
+    /* Separate from Process() so the benchmark can read pkts first */
+    if (edt_pacing) { PacketHeapFree(&Q2_heap); }
+    PacketStoreFree(&pkts);
+    for (int i = 0; i < num_stages; ++i) {
+        StageQueueFree(&stages[i].queue);
+    }
+    free(stages);
+    if (coro_threads) { CoroSchedFree(); }
+    free(servers);
+    free(idle_stack);
+    servers = NULL;
+    idle_stack = NULL;
 }
 
 /* ----------------------- main() ----------------------- */
 
+#ifndef QDISC_BENCH /* bench.c supplies main() */
+
 int main(int argc, char *argv[]) {
     Init();
     ProcessOptions(argc, argv);
@@ -790,8 +2613,13 @@ int main(int argc, char *argv[]) {
     sigemptyset(&set);
     sigaddset(&set, SIGINT);
     sigprocmask(SIG_BLOCK, &set, 0); /* Main thread blocks SIGINT */
-    pthread_create(&signal_thread, NULL, monitor, 0);
+    if (!event_loop) { /* the event loop reads SIGINT from a signalfd */
+        pthread_create(&signal_thread, NULL, monitor, 0);
+    }
 
     Process();
+    Cleanup();
     return(0);
 }
+
+#endif /* ~QDISC_BENCH */
@@ -0,0 +1,91 @@
+/*
+ * Author: Suki Sahota
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "my_math.h"
+
+#include "realtime.h"
+
+/* ----------------------- Utility Functions ----------------------- */
+
+int  RealtimeParseCpus(char *list, int *cpus, int max) {
+    /* "0,2-3" -> {0, 2, 3}; returns the count, 0 if malformed */
+    int count = 0;
+    char *pos = list;
+    while (*pos) {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if (end == pos || first < 0) { return 0; }
+        if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos || last < first) { return 0; }
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (count == max || cpu >= RT_MAX_CPUS) { return 0; }
+            cpus[count++] = (int) cpu;
+        }
+        if (*end == ',') {
+            ++end;
+        } else if (*end != '\0') {
+            return 0;
+        }
+        pos = end;
+    }
+    return count;
+}
+
+#ifdef __linux__
+
+int  RealtimePin(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+#else /* ~__linux__ */
+
+int  RealtimePin(pthread_t thread, int cpu) {
+    return FALSE;
+}
+
+#endif /* __linux__ */
+
+int  RealtimeFifo(pthread_t thread, int priority) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    return pthread_setschedparam(thread, SCHED_FIFO, &param) == 0;
+}
+
+int  RealtimeLockMemory() {
+    /*
+     * Lock pages as they are faulted rather than populating every mapping
+     * (thread stacks, coroutine stacks) up front; the caller prefaults the
+     * pools it will touch.
+     */
+#ifdef MCL_ONFAULT
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0) { return TRUE; }
+#endif /* MCL_ONFAULT */
+    return mlockall(MCL_CURRENT) == 0;
+}
+
+void RealtimePrefault(void *addr, size_t length) {
+    /* Write one byte per page, keeping its contents */
+    long page = sysconf(_SC_PAGESIZE);
+    volatile char *bytes = (volatile char *) addr;
+    for (size_t i = 0; i < length; i += page) {
+        bytes[i] = bytes[i];
+    }
+    if (length > 0) { bytes[length - 1] = bytes[length - 1]; }
+}
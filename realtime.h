@@ -0,0 +1,25 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _REALTIME_H_
+#define _REALTIME_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "my_math.h"
+
+#define RT_MAX_CPUS  1024
+
+/*
+ * CPU pinning, SCHED_FIFO and memory locking for the -rt option.  Each
+ * call reports whether it took effect, so the caller can carry on with
+ * default scheduling when it lacks the privilege.
+ */
+extern int  RealtimeParseCpus(char *list, int *cpus, int max);
+extern int  RealtimePin(pthread_t thread, int cpu);
+extern int  RealtimeFifo(pthread_t thread, int priority);
+extern int  RealtimeLockMemory();
+extern void RealtimePrefault(void *addr, size_t length);
+
+#endif /*_REALTIME_H_*/
@@ -0,0 +1,74 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "my_math.h"
+
+#include "stage_queue.h"
+
+/* ----------------------- Utility Functions ----------------------- */
+
+int  StageQueueInit(StageQueue *queue, int capacity) {
+    unsigned int size = 1;
+    while (size < (unsigned int) capacity) { size <<= 1; }
+
+    memset(queue, 0, sizeof(StageQueue));
+    queue->entries = (StageEntry *) malloc(size * sizeof(StageEntry));
+    if (queue->entries == NULL) { return FALSE; }
+    queue->mask = size - 1;
+    queue->cv = (pthread_cond_t) PTHREAD_COND_INITIALIZER;
+    return TRUE;
+}
+
+void StageQueueFree(StageQueue *queue) {
+    free(queue->entries);
+    queue->entries = NULL;
+}
+
+int  StageQueueLength(StageQueue *queue) {
+    return (int) (queue->tail - queue->head);
+}
+
+int  StageQueueFull(StageQueue *queue) {
+    return StageQueueLength(queue) > (int) queue->mask;
+}
+
+void StageQueueKick(StageQueue *queue) {
+    if (queue->waiting) { pthread_cond_signal(&queue->cv); }
+}
+
+int  StageQueuePush(StageQueue *queue, int num, unsigned long enter) {
+    /* FALSE when full; the producer keeps the packet */
+    if (StageQueueFull(queue)) { return FALSE; }
+    queue->entries[queue->tail & queue->mask].num = num;
+    queue->entries[queue->tail & queue->mask].enter = enter;
+    ++queue->tail;
+    StageQueueKick(queue);
+    return TRUE;
+}
+
+StageEntry *StageQueuePeek(StageQueue *queue) {
+    if (queue->head == queue->tail) { return NULL; }
+    return &queue->entries[queue->head & queue->mask];
+}
+
+void StageQueuePop(StageQueue *queue) {
+    ++queue->head;
+}
+
+void StageQueueWait(StageQueue *queue, pthread_mutex_t *lock,
+                    unsigned long deadline) {
+    /* Caller holds lock; returns at the deadline, after a push, or on a kick */
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000UL;
+    ts.tv_nsec = (deadline % 1000000UL) * 1000UL;
+
+    if (queue->head != queue->tail) { return; }
+    queue->waiting = TRUE;
+    pthread_cond_timedwait(&queue->cv, lock, &ts);
+    queue->waiting = FALSE;
+}
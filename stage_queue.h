@@ -0,0 +1,50 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _STAGE_QUEUE_H_
+#define _STAGE_QUEUE_H_
+
+#include <pthread.h>
+
+#include "my_math.h"
+
+#define STAGE_QUEUE_SIZE  1024 /* packets held by a stage, power of two */
+
+/* A packet waiting in a stage */
+typedef struct tagStageEntry {
+    int num; /* packet number */
+    unsigned long enter; /* when it entered the stage (microseconds) */
+} StageEntry;
+
+/*
+ * Bounded ring joining two shaping stages.  It has no lock of its own:
+ * every call is made with the caller's mutex held (mut in qdisc.c), so
+ * any number of threads may push.  The condition variable parks an idle
+ * consumer on that same mutex until the next push or a deadline.
+ * Deadlines are absolute gettimeofday() microseconds, as in qdisc.c.
+ */
+typedef struct tagStageQueue {
+    StageEntry *entries;
+    unsigned int mask;
+    unsigned int head; /* next entry to pop */
+    unsigned int tail; /* next entry to fill */
+    int waiting; /* TRUE while the consumer is parked */
+    pthread_cond_t cv;
+} StageQueue;
+
+extern int  StageQueueInit(StageQueue*, int capacity);
+extern void StageQueueFree(StageQueue*);
+
+/* Producer side */
+extern int  StageQueuePush(StageQueue*, int num, unsigned long enter);
+extern int  StageQueueFull(StageQueue*);
+
+/* Consumer side */
+extern StageEntry *StageQueuePeek(StageQueue*);
+extern void StageQueuePop(StageQueue*);
+extern void StageQueueWait(StageQueue*, pthread_mutex_t*, unsigned long deadline);
+
+extern int  StageQueueLength(StageQueue*);
+extern void StageQueueKick(StageQueue*);
+
+#endif /*_STAGE_QUEUE_H_*/
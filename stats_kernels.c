@@ -0,0 +1,168 @@
+/*
+ * Author: Suki Sahota
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <float.h>
+
+#include "my_math.h"
+
+#include "stats_kernels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif /* __x86_64__ && __GNUC__ */
+
+/* ----------------------- Scalar Kernels ----------------------- */
+
+static
+void ScalarReduce(const double *values, long count, StatsSummary *summary) {
+    double sum = 0.0, sum_sqr = 0.0;
+    double lo = DBL_MAX, hi = -DBL_MAX;
+    for (long i = 0; i < count; ++i) {
+        double v = values[i];
+        sum += v;
+        sum_sqr += v * v;
+        if (v < lo) { lo = v; }
+        if (v > hi) { hi = v; }
+    }
+    summary->count = count;
+    summary->sum = sum;
+    summary->sum_sqr = sum_sqr;
+    summary->min = lo;
+    summary->max = hi;
+}
+
+static
+int BucketOf(double v, double lo, double inv_width, int num_buckets) {
+    int idx = (int) ((v - lo) * inv_width);
+    if (idx < 0) { idx = 0; }
+    if (idx >= num_buckets) { idx = num_buckets - 1; }
+    return idx;
+}
+
+static
+void ScalarHistogram(const double *values, long count, double lo,
+                     double width, long *buckets, int num_buckets) {
+    double inv_width = 1.0 / width;
+    for (long i = 0; i < count; ++i) {
+        ++buckets[BucketOf(values[i], lo, inv_width, num_buckets)];
+    }
+}
+
+/* ----------------------- AVX2 Kernels ----------------------- */
+
+#ifdef HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2,fma")))
+static
+void Avx2Reduce(const double *values, long count, StatsSummary *summary) {
+    /* Two independent accumulator sets hide the add/fma latency */
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    __m256d sqr0 = _mm256_setzero_pd(), sqr1 = _mm256_setzero_pd();
+    __m256d lo0 = _mm256_set1_pd(DBL_MAX), lo1 = lo0;
+    __m256d hi0 = _mm256_set1_pd(-DBL_MAX), hi1 = hi0;
+
+    long i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256d a = _mm256_loadu_pd(values + i);
+        __m256d b = _mm256_loadu_pd(values + i + 4);
+        sum0 = _mm256_add_pd(sum0, a);
+        sum1 = _mm256_add_pd(sum1, b);
+        sqr0 = _mm256_fmadd_pd(a, a, sqr0);
+        sqr1 = _mm256_fmadd_pd(b, b, sqr1);
+        lo0 = _mm256_min_pd(lo0, a);
+        lo1 = _mm256_min_pd(lo1, b);
+        hi0 = _mm256_max_pd(hi0, a);
+        hi1 = _mm256_max_pd(hi1, b);
+    }
+
+    double lane_sum[4], lane_sqr[4], lane_lo[4], lane_hi[4];
+    _mm256_storeu_pd(lane_sum, _mm256_add_pd(sum0, sum1));
+    _mm256_storeu_pd(lane_sqr, _mm256_add_pd(sqr0, sqr1));
+    _mm256_storeu_pd(lane_lo, _mm256_min_pd(lo0, lo1));
+    _mm256_storeu_pd(lane_hi, _mm256_max_pd(hi0, hi1));
+
+    /* Remainder, then fold the lanes */
+    ScalarReduce(values + i, count - i, summary);
+    for (int lane = 0; lane < 4; ++lane) {
+        summary->sum += lane_sum[lane];
+        summary->sum_sqr += lane_sqr[lane];
+        summary->min = min(summary->min, lane_lo[lane]);
+        summary->max = max(summary->max, lane_hi[lane]);
+    }
+    summary->count = count;
+}
+
+__attribute__((target("avx2")))
+static
+void Avx2Histogram(const double *values, long count, double lo,
+                   double width, long *buckets, int num_buckets) {
+    /* Bucket indices are computed four at a time; increments are scalar */
+    double inv_width = 1.0 / width;
+    __m256d vlo = _mm256_set1_pd(lo);
+    __m256d vinv = _mm256_set1_pd(inv_width);
+    __m128i zero = _mm_setzero_si128();
+    __m128i last = _mm_set1_epi32(num_buckets - 1);
+    int idx[4];
+
+    long i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        __m256d scaled = _mm256_mul_pd(_mm256_sub_pd(v, vlo), vinv);
+        __m128i bucket = _mm256_cvttpd_epi32(scaled);
+        bucket = _mm_min_epi32(_mm_max_epi32(bucket, zero), last);
+        _mm_storeu_si128((__m128i *) idx, bucket);
+        ++buckets[idx[0]];
+        ++buckets[idx[1]];
+        ++buckets[idx[2]];
+        ++buckets[idx[3]];
+    }
+    ScalarHistogram(values + i, count - i, lo, width, buckets, num_buckets);
+}
+
+static
+int UseAvx2() {
+    static int supported = -1;
+    if (supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("avx2") &&
+                    __builtin_cpu_supports("fma");
+    }
+    return supported;
+}
+
+#endif /* HAVE_AVX2_KERNELS */
+
+/* ----------------------- Utility Functions ----------------------- */
+
+void StatsReduce(const double *values, long count, StatsSummary *summary) {
+#ifdef HAVE_AVX2_KERNELS
+    if (UseAvx2()) {
+        Avx2Reduce(values, count, summary);
+        return;
+    }
+#endif /* HAVE_AVX2_KERNELS */
+    ScalarReduce(values, count, summary);
+}
+
+void StatsHistogram(const double *values, long count, double lo,
+                    double width, long *buckets, int num_buckets) {
+    if (width <= 0) { width = 1.0; }
+#ifdef HAVE_AVX2_KERNELS
+    if (UseAvx2()) {
+        Avx2Histogram(values, count, lo, width, buckets, num_buckets);
+        return;
+    }
+#endif /* HAVE_AVX2_KERNELS */
+    ScalarHistogram(values, count, lo, width, buckets, num_buckets);
+}
+
+char *StatsKernelName() {
+#ifdef HAVE_AVX2_KERNELS
+    if (UseAvx2()) { return "avx2"; }
+#endif /* HAVE_AVX2_KERNELS */
+    return "scalar";
+}
@@ -0,0 +1,27 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _STATS_KERNELS_H_
+#define _STATS_KERNELS_H_
+
+#include "my_math.h"
+
+typedef struct tagStatsSummary {
+    long count;
+    double sum;
+    double sum_sqr;
+    double min;
+    double max;
+} StatsSummary;
+
+/*
+ * Post-run reductions over contiguous arrays of durations.  On x86-64 the
+ * AVX2 versions are chosen at run time when the CPU supports them;
+ * otherwise the scalar versions are used.
+ */
+extern void StatsReduce(const double *values, long count, StatsSummary *summary);
+extern void StatsHistogram(const double *values, long count, double lo,
+                           double width, long *buckets, int num_buckets);
+extern char *StatsKernelName();
+
+#endif /*_STATS_KERNELS_H_*/
@@ -0,0 +1,188 @@
+/*
+ * Author: Suki Sahota
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "my_math.h"
+
+#include "udp_io.h"
+
+/* Slot pool shared by the receiving packet thread and the servers */
+static char *slab;
+static int *free_slots;
+static int num_free;
+static int num_slots;
+static pthread_mutex_t pool_mut = PTHREAD_MUTEX_INITIALIZER;
+
+/* ----------------------- Utility Functions ----------------------- */
+
+int  UdpPoolInit(int slots) {
+    slab = (char *) malloc((size_t) slots * UDP_SLOT_SIZE);
+    free_slots = (int *) malloc(slots * sizeof(int));
+    if (slab == NULL || free_slots == NULL) { return FALSE; }
+    for (int i = 0; i < slots; ++i) {
+        free_slots[i] = slots - 1 - i;
+    }
+    num_free = num_slots = slots;
+    return TRUE;
+}
+
+void UdpPoolFree() {
+    free(slab);
+    free(free_slots);
+    slab = NULL;
+    free_slots = NULL;
+    num_free = num_slots = 0;
+}
+
+void UdpPoolPrefault() {
+    /* Touch the whole slab up front instead of on the first receives */
+    memset(slab, 0, (size_t) num_slots * UDP_SLOT_SIZE);
+}
+
+char *UdpSlot(int slot) {
+    return slab + (size_t) slot * UDP_SLOT_SIZE;
+}
+
+void UdpReleaseSlot(int slot) {
+    pthread_mutex_lock(&pool_mut);
+    free_slots[num_free++] = slot;
+    pthread_mutex_unlock(&pool_mut);
+}
+
+int  UdpFreeSlots() {
+    pthread_mutex_lock(&pool_mut);
+    int count = num_free;
+    pthread_mutex_unlock(&pool_mut);
+    return count;
+}
+
+int  UdpOpen(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) { return -1; }
+
+    int rcvbuf = 4 << 20; /* absorb bursts while the bucket is empty */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+#ifdef __linux__
+
+int  UdpRecvBatch(int fd, int *slots, int *lens, int max) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+
+    /* Take as many free slots as we are allowed to fill */
+    pthread_mutex_lock(&pool_mut);
+    if (max > UDP_BATCH) { max = UDP_BATCH; }
+    if (max > num_free) { max = num_free; }
+    for (int i = 0; i < max; ++i) {
+        slots[i] = free_slots[--num_free];
+    }
+    pthread_mutex_unlock(&pool_mut);
+    if (max == 0) { return 0; }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < max; ++i) {
+        iovecs[i].iov_base = UdpSlot(slots[i]);
+        iovecs[i].iov_len = UDP_SLOT_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Block for the first datagram, then take whatever else is queued */
+    int received = recvmmsg(fd, msgs, max, MSG_WAITFORONE, NULL);
+    if (received < 0) { received = 0; }
+    for (int i = 0; i < received; ++i) {
+        lens[i] = (int) msgs[i].msg_len;
+    }
+    for (int i = received; i < max; ++i) {
+        UdpReleaseSlot(slots[i]);
+    }
+    return received;
+}
+
+int  UdpSendBatch(int fd, int port, int *slots, int *lens, int count) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    int sent = 0;
+    while (sent < count) {
+        int chunk = min(count - sent, UDP_BATCH);
+        memset(msgs, 0, chunk * sizeof(struct mmsghdr));
+        for (int i = 0; i < chunk; ++i) {
+            iovecs[i].iov_base = UdpSlot(slots[sent + i]);
+            iovecs[i].iov_len = lens[sent + i];
+            msgs[i].msg_hdr.msg_name = &addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int result = sendmmsg(fd, msgs, chunk, 0);
+        if (result <= 0) { break; }
+        sent += result;
+    }
+    return sent;
+}
+
+#else /* ~__linux__ */
+
+int  UdpRecvBatch(int fd, int *slots, int *lens, int max) {
+    /* No recvmmsg(); fall back to one datagram per call */
+    pthread_mutex_lock(&pool_mut);
+    if (num_free == 0 || max == 0) {
+        pthread_mutex_unlock(&pool_mut);
+        return 0;
+    }
+    slots[0] = free_slots[--num_free];
+    pthread_mutex_unlock(&pool_mut);
+
+    ssize_t len = recv(fd, UdpSlot(slots[0]), UDP_SLOT_SIZE, 0);
+    if (len < 0) {
+        UdpReleaseSlot(slots[0]);
+        return 0;
+    }
+    lens[0] = (int) len;
+    return 1;
+}
+
+int  UdpSendBatch(int fd, int port, int *slots, int *lens, int count) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    int sent = 0;
+    for (; sent < count; ++sent) {
+        if (sendto(fd, UdpSlot(slots[sent]), lens[sent], 0,
+                   (struct sockaddr *) &addr, sizeof(addr)) < 0) { break; }
+    }
+    return sent;
+}
+
+#endif /* __linux__ */
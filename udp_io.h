@@ -0,0 +1,29 @@
+/*
+ * Author: Suki Sahota
+ */
+#ifndef _UDP_IO_H_
+#define _UDP_IO_H_
+
+#include "my_math.h"
+
+#define UDP_BATCH  32 /* datagrams per recvmmsg()/sendmmsg() call */
+#define UDP_SLOTS  4096 /* datagrams buffered inside the shaper at once */
+#define UDP_SLOT_SIZE  2048 /* bytes per datagram slot */
+
+/*
+ * Datagrams are received straight into fixed slots of a preallocated slab
+ * and sent from the same slot, so payloads are never copied between the
+ * Q1/bucket/Q2/server stages; a packet only carries its slot index.
+ */
+extern int  UdpPoolInit(int slots);
+extern void UdpPoolFree();
+extern void UdpPoolPrefault();
+extern char *UdpSlot(int slot);
+extern void UdpReleaseSlot(int slot);
+extern int  UdpFreeSlots();
+
+extern int  UdpOpen(int port);
+extern int  UdpRecvBatch(int fd, int *slots, int *lens, int max);
+extern int  UdpSendBatch(int fd, int port, int *slots, int *lens, int count);
+
+#endif /*_UDP_IO_H_*/
@@ -0,0 +1,210 @@
+/*
+ * Author: Suki Sahota
+ *
+ * Loopback load generator for "qdisc -udp in_port:out_port".  Sends
+ * sequenced, timestamped datagrams to in_port and receives the shaped
+ * stream on out_port, reporting packets per second and one-way latency.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "my_math.h"
+
+#include "udp_io.h"
+
+#define NSEC_PER_SEC  1000000000UL
+#define NSEC_TO_MIC  1000UL
+#define IDLE_TIMEOUT  2 /* seconds without a shaped datagram before giving up */
+
+/* Datagram header; the remainder of the payload is padding */
+typedef struct tagProbe {
+    unsigned long seq;
+    unsigned long sent_ns; /* CLOCK_MONOTONIC */
+} Probe;
+
+/* Commandline options */
+int in_port, out_port;
+long n;
+double pps;
+long size;
+
+int sink_fd;
+unsigned long *latencies; /* nanoseconds, indexed by arrival order */
+long received;
+unsigned long first_recv_ns, last_recv_ns;
+
+/* ----------------------- Utility Functions ----------------------- */
+
+void Usage() {
+    fprintf(stderr,
+            "usage: udpgen -port in_port -sink out_port [-n num] [-rate pps] [-size bytes]\n");
+    exit(1);
+}
+
+unsigned long NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static
+void ProcessOptions(int argc, char *argv[]) {
+    n = 1000;
+    pps = 0.0; /* as fast as possible */
+    size = 64;
+    in_port = out_port = 0;
+
+    for (--argc, ++argv; argc > 0; argc -= 2, argv += 2) {
+        if (argc == 1) { Usage(); }
+        if (strcmp(argv[0], "-port") == 0) {
+            in_port = (int) strtol(argv[1], 0, 10);
+        } else if (strcmp(argv[0], "-sink") == 0) {
+            out_port = (int) strtol(argv[1], 0, 10);
+        } else if (strcmp(argv[0], "-n") == 0) {
+            n = strtol(argv[1], 0, 10);
+        } else if (strcmp(argv[0], "-rate") == 0) {
+            pps = strtod(argv[1], NULL);
+        } else if (strcmp(argv[0], "-size") == 0) {
+            size = strtol(argv[1], 0, 10);
+        } else {
+            Usage();
+        }
+    }
+    if (in_port <= 0 || out_port <= 0 || n <= 0 || n > INT_MAX || pps < 0 ||
+        size < (long) sizeof(Probe) || size > UDP_SLOT_SIZE)
+    {
+        Usage();
+    }
+}
+
+int CompareLatency(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+    return (x > y) - (x < y);
+}
+
+/* ----------------------- Threads ----------------------- */
+
+void *sink_thread_func(void *arg) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+    static char bufs[UDP_BATCH][UDP_SLOT_SIZE];
+    struct timeval tv = { IDLE_TIMEOUT, 0 };
+    setsockopt(sink_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (received < n) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; ++i) {
+            iovecs[i].iov_base = bufs[i];
+            iovecs[i].iov_len = UDP_SLOT_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int count = recvmmsg(sink_fd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (count <= 0) { break; } /* idle timeout */
+
+        unsigned long now = NowNs();
+        if (received == 0) { first_recv_ns = now; }
+        last_recv_ns = now;
+        for (int i = 0; i < count && received < n; ++i) {
+            Probe *probe = (Probe *) bufs[i];
+            latencies[received++] = now - probe->sent_ns;
+        }
+    }
+    return (void *) 0;
+}
+
+/* ----------------------- main() ----------------------- */
+
+int main(int argc, char *argv[]) {
+    ProcessOptions(argc, argv);
+
+    int src_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sink_fd = UdpOpen(out_port);
+    if (src_fd < 0 || sink_fd < 0) {
+        perror("udpgen");
+        exit(1);
+    }
+    latencies = (unsigned long *) malloc(n * sizeof(unsigned long));
+
+    pthread_t sink_thread;
+    pthread_create(&sink_thread, NULL, sink_thread_func, 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(in_port);
+
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovecs[UDP_BATCH];
+    static char bufs[UDP_BATCH][UDP_SLOT_SIZE];
+    unsigned long begin = NowNs();
+    long sent = 0;
+
+    while (sent < n) {
+        int chunk = (int) min(n - sent, UDP_BATCH);
+        if (pps > 0) {
+            /* Pace to the requested rate, one datagram per send */
+            unsigned long due = begin + (unsigned long) (sent * NSEC_PER_SEC / pps);
+            unsigned long now = NowNs();
+            if (due > now) { usleep((due - now) / NSEC_TO_MIC); }
+            chunk = 1;
+        }
+        memset(msgs, 0, chunk * sizeof(struct mmsghdr));
+        unsigned long now = NowNs();
+        for (int i = 0; i < chunk; ++i) {
+            Probe *probe = (Probe *) bufs[i];
+            probe->seq = sent + i;
+            probe->sent_ns = now;
+            iovecs[i].iov_base = bufs[i];
+            iovecs[i].iov_len = size;
+            msgs[i].msg_hdr.msg_name = &addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int result = sendmmsg(src_fd, msgs, chunk, 0);
+        if (result < 0) {
+            perror("sendmmsg");
+            break;
+        }
+        sent += result;
+    }
+    unsigned long send_end = NowNs();
+
+    pthread_join(sink_thread, NULL);
+
+    fprintf(stdout, "sent = %ld\n", sent);
+    fprintf(stdout, "received = %ld\n", received);
+    fprintf(stdout, "send rate = %.6g pps\n",
+            sent / ((double) (send_end - begin) / NSEC_PER_SEC));
+    if (received > 1) {
+        fprintf(stdout, "shaped rate = %.6g pps\n",
+                (received - 1) / ((double) (last_recv_ns - first_recv_ns) / NSEC_PER_SEC));
+    }
+    if (received > 0) {
+        qsort(latencies, received, sizeof(unsigned long), CompareLatency);
+        double total = 0.0;
+        for (long i = 0; i < received; ++i) { total += latencies[i]; }
+        fprintf(stdout, "latency avg = %.3fms\n", total / received / 1e6);
+        fprintf(stdout, "latency p50 = %.3fms\n", latencies[received / 2] / 1e6);
+        fprintf(stdout, "latency p99 = %.3fms\n",
+                latencies[(long) (received * 0.99)] / 1e6);
+        fprintf(stdout, "latency max = %.3fms\n", latencies[received - 1] / 1e6);
+    }
+
+    free(latencies);
+    close(src_fd);
+    close(sink_fd);
+    return(0);
+}